@@ -0,0 +1,436 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <math.h>
+#include <float.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "raytracer.h"
+
+/*
+ * Build and trace timings of the acceleration structures on a dense field of
+ * similar sized spheres, the kind of scene generate_random_spheres() makes.
+ *
+ *   raytracer_bench [spheres] [rays]
+ *
+ * The last section renders a small closed room with the path tracer, it is
+ * the number to compare across builds that change the shading code or the
+ * vector math, e.g. make bench-precision.
+ */
+
+typedef struct
+{
+  const char *name;
+  BVHBuilder builder;
+  AccelType accel;
+} Backend;
+
+static const Backend backends[] = {
+  {"bvh sah", BVH_SAH, ACCEL_BVH},
+  {"bvh lbvh", BVH_LBVH, ACCEL_BVH},
+  {"bvh8 sah", BVH_SAH, ACCEL_BVH8},
+  {"grid", BVH_SAH, ACCEL_GRID},
+};
+
+/* jittered lattice, neighbouring spheres never overlap */
+static void packed_spheres(Object *objects, size_t n)
+{
+  int side = (int)ceil(cbrt((double)n));
+  const double spacing = 2.0;
+  const double offset = -0.5 * spacing * side;
+
+  for (uint i = 0; i < n; i++)
+  {
+    int x = i % side, y = (i / side) % side, z = i / (side * side);
+    double radius = random_range(0.6, 0.9);
+    double jitter = 0.5 * spacing - radius;
+    objects[i] = (Object){
+      .center = {
+        offset + (x + 0.5) * spacing + random_range(-jitter, jitter),
+        offset + (y + 0.5) * spacing + random_range(-jitter, jitter),
+        offset + (z + 0.5) * spacing + random_range(-jitter, jitter),
+      },
+      .radius = radius,
+      .color = WHITE,
+    };
+  }
+}
+
+/* rows x cols quads around a torus, two triangles each */
+static void torus_mesh(TriangleMesh *mesh, uint rows, uint cols, double major, double minor)
+{
+  *mesh = (TriangleMesh){.num_triangles = 2 * rows * cols};
+  mesh->vertices = malloc(sizeof(*mesh->vertices) * mesh->num_triangles * 3);
+  assert(mesh->vertices != NULL);
+
+  Vertex *v = mesh->vertices;
+  for (uint i = 0; i < rows; i++)
+    for (uint j = 0; j < cols; j++)
+    {
+      Vertex corners[4];
+      for (uint k = 0; k < 4; k++)
+      {
+        double a = 2 * PI * (i + (k == 1 || k == 2)) / rows;
+        double b = 2 * PI * (j + (k >= 2)) / cols;
+        corners[k].pos = VECTOR((major + minor * cos(b)) * cos(a), minor * sin(b), (major + minor * cos(b)) * sin(a));
+        corners[k].tex = (vec2){(double)i / rows, (double)j / cols};
+      }
+      *v++ = corners[0]; *v++ = corners[1]; *v++ = corners[2];
+      *v++ = corners[0]; *v++ = corners[2]; *v++ = corners[3];
+    }
+}
+
+/* five walls, a ceiling light and one sphere of each material */
+static size_t path_scene(Object *objects)
+{
+  const vec3 grey = VECTOR(0.75, 0.75, 0.75);
+  const Object room[] = {
+    {.type = GEOMETRY_QUAD, .center = {-10, -10, -10}, .edge_u = {20, 0, 0}, .edge_v = {0, 0, 30}, .color = grey},
+    {.type = GEOMETRY_QUAD, .center = {-10, -10, -10}, .edge_u = {20, 0, 0}, .edge_v = {0, 20, 0}, .color = grey},
+    {.type = GEOMETRY_QUAD, .center = {-10, -10, -10}, .edge_u = {0, 0, 30}, .edge_v = {0, 20, 0}, .color = VECTOR(0.25, 0.75, 0.25)},
+    {.type = GEOMETRY_QUAD, .center = {10, -10, -10}, .edge_u = {0, 0, 30}, .edge_v = {0, 20, 0}, .color = VECTOR(0.75, 0.25, 0.25)},
+    {.type = GEOMETRY_QUAD, .center = {-10, 10, -10}, .edge_u = {20, 0, 0}, .edge_v = {0, 0, 30}, .color = grey},
+    {.type = GEOMETRY_QUAD, .center = {-3, 9.9, -3}, .edge_u = {6, 0, 0}, .edge_v = {0, 0, 6}, .color = BLACK, .emission = VECTOR(12, 12, 12)},
+    {.type = GEOMETRY_SPHERE, .center = {-5, -6, -2}, .radius = 4, .color = grey, .flags = M_DEFAULT},
+    {.type = GEOMETRY_SPHERE, .center = {5, -6, 2}, .radius = 4, .color = WHITE, .flags = M_REFLECTION},
+    {.type = GEOMETRY_SPHERE, .center = {0, 4, 4}, .radius = 3, .color = WHITE, .flags = M_REFRACTION},
+  };
+  memcpy(objects, room, sizeof(room));
+  return sizeof(room) / sizeof(room[0]);
+}
+
+/* half the rays come from outside like camera rays, half start inside like bounces */
+static void random_rays(Ray *rays, size_t n, double extent)
+{
+  for (uint i = 0; i < n; i++)
+  {
+    vec3 origin, target = {random_range(-extent, extent), random_range(-extent, extent), random_range(-extent, extent)};
+    if (i % 2 == 0)
+      origin = vec3_scalar_mult(vec3_normalize((vec3){random_range(-1, 1), random_range(-1, 1), random_range(-1, 1)}), 3 * extent);
+    else
+      origin = (vec3){random_range(-extent, extent), random_range(-extent, extent), random_range(-extent, extent)};
+    rays[i] = (Ray){origin, vec3_normalize(vec3_sub(target, origin))};
+  }
+}
+
+/* pinhole camera outside the field, rays ordered in PACKET_WIDTH x PACKET_HEIGHT tiles */
+static void camera_rays(Ray *rays, uint width, uint height, double extent)
+{
+  vec3 eye = {0.3 * extent, 0.2 * extent, 3 * extent};
+  uint n = 0;
+
+  for (uint y0 = 0; y0 < height; y0 += PACKET_HEIGHT)
+    for (uint x0 = 0; x0 < width; x0 += PACKET_WIDTH)
+      for (uint i = 0; i < PACKET_SIZE; i++)
+      {
+        double u = 2.0 * (x0 + i % PACKET_WIDTH + 0.5) / width - 1.0;
+        double v = 2.0 * (y0 + i / PACKET_WIDTH + 0.5) / height - 1.0;
+        vec3 target = {u * 1.2 * extent, v * 1.2 * extent, 0};
+        rays[n++] = (Ray){eye, vec3_normalize(vec3_sub(target, eye))};
+      }
+}
+
+/*
+ * Between two accumulation buffers in linear radiance, each divided by its
+ * sample count. With blur the difference is box filtered over radius
+ * pixels first, which keeps the low frequency part of the error, the part
+ * that shows as blotches rather than grain.
+ */
+static double rmse(const float *a, uint a_samples, const float *b, uint b_samples, uint width, uint height, int blur)
+{
+  double sum = 0;
+  for (int y = 0; y < (int)height; y++)
+    for (int x = 0; x < (int)width; x++)
+      for (int c = 0; c < 3; c++)
+      {
+        double d = 0;
+        int taps = 0;
+        for (int yy = MAX(y - blur, 0); yy <= MIN(y + blur, (int)height - 1); yy++)
+          for (int xx = MAX(x - blur, 0); xx <= MIN(x + blur, (int)width - 1); xx++, taps++)
+          {
+            size_t i = ((size_t)yy * width + xx) * 3 + c;
+            d += (double)a[i] / a_samples - (double)b[i] / b_samples;
+          }
+        d /= taps;
+        sum += d * d;
+      }
+  return sqrt(sum / ((size_t)width * height * 3));
+}
+
+int main(int argc, char **argv)
+{
+  size_t num_spheres = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+  size_t num_rays = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+
+  init_kernels(ISA_AVX512);
+
+  srand(1);
+  Object *objects = malloc(sizeof(*objects) * num_spheres);
+  Ray *rays = malloc(sizeof(*rays) * num_rays);
+  assert(objects != NULL && rays != NULL);
+
+  packed_spheres(objects, num_spheres);
+  random_rays(rays, num_rays, cbrt((double)num_spheres));
+
+  printf("%zu packed spheres, %zu rays, %d threads, %s precision, %s kernels\n", num_spheres, num_rays, omp_get_max_threads(), sizeof(REAL) == sizeof(float) ? "single" : "double", isa_name(kernels.isa));
+  printf("%-10s %10s %10s %12s %10s\n", "backend", "build ms", "trace ms", "Mrays/s", "hits");
+
+  for (uint b = 0; b < sizeof(backends) / sizeof(backends[0]); b++)
+  {
+    Options options = {.builder = backends[b].builder, .accel = backends[b].accel};
+    Scene scene;
+
+    double start = omp_get_wtime();
+    init_scene(&scene, objects, num_spheres, &options);
+    double build = omp_get_wtime() - start;
+
+    long long hits = 0;
+    start = omp_get_wtime();
+    #pragma omp parallel for schedule(dynamic, 1024) reduction(+:hits)
+    for (size_t i = 0; i < num_rays; i++)
+    {
+      Hit hit = {.t = REAL_MAX};
+      hits += intersect(&rays[i], &scene, &hit);
+    }
+    double trace = omp_get_wtime() - start;
+
+    printf("%-10s %10.1f %10.1f %12.2f %10lld\n", backends[b].name, build * 1e3, trace * 1e3, num_rays / trace * 1e-6, hits);
+    free_scene(&scene);
+  }
+
+  /* coherent primary rays, one at a time against packets through the same SAH tree */
+  const uint width = 512, height = 512;
+  Ray *primary = malloc(sizeof(*primary) * width * height);
+  assert(primary != NULL);
+  camera_rays(primary, width, height, cbrt((double)num_spheres));
+
+  Options options = {.builder = BVH_SAH, .accel = ACCEL_BVH};
+  Scene scene;
+  init_scene(&scene, objects, num_spheres, &options);
+
+  printf("\n%ux%u camera rays\n", width, height);
+  printf("%-10s %10s %12s %10s\n", "mode", "trace ms", "Mrays/s", "hits");
+
+  for (int packets = 0; packets <= 1; packets++)
+  {
+    long long hits = 0;
+    double start = omp_get_wtime();
+    #pragma omp parallel for schedule(dynamic, 64) reduction(+:hits)
+    for (size_t p = 0; p < width * height / PACKET_SIZE; p++)
+    {
+      Hit hit[PACKET_SIZE];
+      if (packets)
+      {
+        hits += __builtin_popcount(intersect_packet(&primary[p * PACKET_SIZE], (1u << PACKET_SIZE) - 1, &scene, hit));
+      }
+      else
+      {
+        for (uint i = 0; i < PACKET_SIZE; i++)
+        {
+          hit[i] = (Hit){.t = REAL_MAX};
+          hits += intersect(&primary[p * PACKET_SIZE + i], &scene, &hit[i]);
+        }
+      }
+    }
+    double trace = omp_get_wtime() - start;
+
+    printf("%-10s %10.1f %12.2f %10lld\n", packets ? "packet" : "single", trace * 1e3, width * height / trace * 1e-6, hits);
+  }
+
+  /*
+   * Two generations of diffuse bounces off those hits, traced in pixel order
+   * and after sort_rays(). The sorted rays are moved into the new order, as
+   * the wavefront queue does, and that counts towards the sort.
+   */
+  Ray *bounces = malloc(sizeof(*bounces) * width * height);
+  Ray *sorted_bounces = malloc(sizeof(*sorted_bounces) * width * height);
+  uint64_t *keys = malloc(sizeof(*keys) * width * height);
+  uint *order = malloc(sizeof(*order) * width * height);
+  assert(bounces != NULL && sorted_bounces != NULL && keys != NULL && order != NULL);
+
+  memcpy(bounces, primary, sizeof(*primary) * width * height);
+  size_t num_bounces = width * height;
+
+  printf("\n%-10s %10s %10s %10s %12s %10s\n", "bounce", "rays", "sort ms", "trace ms", "Mrays/s", "hit rate");
+
+  Sampler sampler = sampler_seed(SAMPLER_RANDOM, 1, 0, 0, 0);
+  for (int bounce = 1; bounce <= 2; bounce++)
+  {
+    size_t n = 0;
+    for (size_t i = 0; i < num_bounces; i++)
+    {
+      Hit hit = {.t = REAL_MAX};
+      if (intersect(&bounces[i], &scene, &hit))
+        bounces[n++] = spawn_ray(&hit, random_cosine_direction(hit.normal, &sampler));
+    }
+    num_bounces = n;
+
+    for (int sorted = 0; sorted <= 1; sorted++)
+    {
+      double start = omp_get_wtime();
+      if (sorted)
+      {
+        sort_rays(bounces, num_bounces, keys, order);
+        for (size_t i = 0; i < num_bounces; i++)
+          sorted_bounces[i] = bounces[order[i]];
+      }
+      double sort = omp_get_wtime() - start;
+      const Ray *rays = sorted ? sorted_bounces : bounces;
+
+      long long hits = 0;
+      start = omp_get_wtime();
+      #pragma omp parallel for schedule(dynamic, 1024) reduction(+:hits)
+      for (size_t i = 0; i < num_bounces; i++)
+      {
+        Hit hit = {.t = REAL_MAX};
+        hits += intersect(&rays[i], &scene, &hit);
+      }
+      double trace = omp_get_wtime() - start;
+
+      printf("%d %-8s %10zu %10.1f %10.1f %12.2f %9.1f%%\n", bounce, sorted ? "sorted" : "pixel", num_bounces, sort * 1e3, trace * 1e3, num_bounces / (sort + trace) * 1e-6, 100.0 * hits / num_bounces);
+    }
+  }
+
+  free(order);
+  free(keys);
+  free(sorted_bounces);
+  free(bounces);
+  free_scene(&scene);
+
+  /* one large mesh, all the time goes into the mesh BVH and its leaves */
+  TriangleMesh torus;
+  torus_mesh(&torus, 250, 200, 5, 2);
+  random_rays(primary, width * height, 7);
+
+  printf("\n%zu triangle torus, %u rays\n", torus.num_triangles, width * height);
+  printf("%-10s %10s %12s %10s\n", "backend", "trace ms", "Mrays/s", "hits");
+
+  for (uint b = 0; b < sizeof(backends) / sizeof(backends[0]); b++)
+  {
+    if (backends[b].builder != BVH_SAH || backends[b].accel == ACCEL_GRID)
+      continue;
+
+    Object mesh_object = {.type = GEOMETRY_MESH, .mesh = &torus};
+    Options options = {.builder = BVH_SAH, .accel = backends[b].accel};
+    init_scene(&scene, &mesh_object, 1, &options);
+
+    long long hits = 0;
+    double start = omp_get_wtime();
+    #pragma omp parallel for schedule(dynamic, 1024) reduction(+:hits)
+    for (size_t i = 0; i < width * height; i++)
+    {
+      Hit hit = {.t = REAL_MAX};
+      hits += intersect(&primary[i], &scene, &hit);
+    }
+    double trace = omp_get_wtime() - start;
+
+    printf("%-10s %10.1f %12.2f %10lld\n", backends[b].name, trace * 1e3, width * height / trace * 1e-6, hits);
+    free_scene(&scene);
+  }
+
+  free_mesh(&torus);
+
+  /* whole frames through both integrators, shading and vector math included */
+  Options path_options = {.width = 128, .height = 72, .samples = 16, .builder = BVH_SAH, .accel = ACCEL_BVH};
+  Object room[16];
+  init_scene(&scene, room, path_scene(room), &path_options);
+
+  Camera camera;
+  init_camera(&camera, VECTOR(0, 0, 19), VECTOR(0, 0, 0), &path_options);
+  float *accumulation = calloc((size_t)path_options.width * path_options.height * 3, sizeof(*accumulation));
+  assert(accumulation != NULL);
+
+  /* render() prints its progress, the table goes out once both are done */
+  double render_time[2];
+  long long render_rays[2];
+  for (int wavefront = 0; wavefront <= 1; wavefront++)
+  {
+    path_options.integrator = wavefront ? INTEGRATOR_WAVEFRONT : INTEGRATOR_RECURSIVE;
+    long long rays = ray_count;
+    double start = omp_get_wtime();
+    render(accumulation, &scene, &camera, &path_options);
+    render_time[wavefront] = omp_get_wtime() - start;
+    render_rays[wavefront] = ray_count - rays;
+  }
+
+  size_t paths = (size_t)path_options.width * path_options.height * path_options.samples;
+  printf("\n%dx%d room path traced, %d samples\n", path_options.width, path_options.height, path_options.samples);
+  printf("%-10s %10s %12s %12s\n", "integrator", "render ms", "Mpaths/s", "Mrays/s");
+  for (int wavefront = 0; wavefront <= 1; wavefront++)
+    printf("%-10s %10.1f %12.3f %12.3f\n", wavefront ? "wavefront" : "recursive", render_time[wavefront] * 1e3, paths / render_time[wavefront] * 1e-6, render_rays[wavefront] / render_time[wavefront] * 1e-6);
+
+  /* error at equal sample counts against a converged frame of the same room */
+  const uint reference_samples = 2048, sample_counts[] = {1, 4, 16, 64};
+  const SamplerType samplers[] = {SAMPLER_RANDOM, SAMPLER_SOBOL, SAMPLER_BLUE_NOISE};
+  const char *sampler_names[] = {"random", "sobol", "bluenoise"};
+  const uint num_counts = sizeof(sample_counts) / sizeof(sample_counts[0]);
+  const uint num_samplers = sizeof(samplers) / sizeof(samplers[0]);
+  Options error_options = {.width = 64, .height = 36, .builder = BVH_SAH, .accel = ACCEL_BVH, .seed = 1};
+  size_t error_pixels = (size_t)error_options.width * error_options.height;
+  init_camera(&camera, VECTOR(0, 0, 19), VECTOR(0, 0, 0), &error_options);
+  float *reference = malloc(sizeof(*reference) * error_pixels * 3);
+  float *estimate = malloc(sizeof(*estimate) * error_pixels * 3);
+  assert(reference != NULL && estimate != NULL);
+
+  error_options.samples = reference_samples;
+  error_options.sampler = SAMPLER_SOBOL;
+  render(reference, &scene, &camera, &error_options);
+
+  /* a few bright paths decide the error at low counts, every entry is the mean over error_frames seeds */
+  const uint error_frames = 4;
+  double error[3][4][2] = {{{0}}};
+  for (uint k = 0; k < num_counts; k++)
+    for (uint s = 0; s < num_samplers; s++)
+      for (uint f = 0; f < error_frames; f++)
+      {
+        error_options.samples = sample_counts[k];
+        error_options.sampler = samplers[s];
+        error_options.seed = 2 + f;
+        render(estimate, &scene, &camera, &error_options);
+        for (int blur = 0; blur <= 1; blur++)
+          error[s][k][blur] += rmse(estimate, sample_counts[k], reference, reference_samples, error_options.width, error_options.height, 2 * blur) / error_frames;
+      }
+
+  printf("\n%dx%d room RMSE against %u samples, plain and after a 5x5 box filter, mean of %u frames\n", error_options.width, error_options.height, reference_samples, error_frames);
+  printf("%-10s", "samples");
+  for (uint s = 0; s < num_samplers; s++)
+    printf(" %10s %10s", sampler_names[s], "filtered");
+  printf("\n");
+  for (uint k = 0; k < num_counts; k++)
+  {
+    printf("%-10u", sample_counts[k]);
+    for (uint s = 0; s < num_samplers; s++)
+      printf(" %10.4f %10.4f", error[s][k][0], error[s][k][1]);
+    printf("\n");
+  }
+
+  /* the same with independent numbers everywhere but the camera samples, at counts that are not a square */
+  const uint pattern_counts[] = {3, 10, 24};
+  double pattern_error[3][3] = {{0}};
+  error_options.sampler = SAMPLER_RANDOM;
+  for (uint k = 0; k < 3; k++)
+    for (PixelPattern pattern = PIXEL_JITTER; pattern <= PIXEL_CMJ; pattern++)
+      for (uint f = 0; f < error_frames; f++)
+      {
+        error_options.samples = pattern_counts[k];
+        error_options.pixel = pattern;
+        error_options.seed = 2 + f;
+        render(estimate, &scene, &camera, &error_options);
+        pattern_error[pattern][k] += rmse(estimate, pattern_counts[k], reference, reference_samples, error_options.width, error_options.height, 0) / error_frames;
+      }
+
+  printf("\n%-10s %10s %10s %10s\n", "samples", "jitter", "stratified", "cmj");
+  for (uint k = 0; k < 3; k++)
+    printf("%-10u %10.4f %10.4f %10.4f\n", pattern_counts[k], pattern_error[PIXEL_JITTER][k], pattern_error[PIXEL_STRATIFIED][k], pattern_error[PIXEL_CMJ][k]);
+
+  free(estimate);
+  free(reference);
+  free(accumulation);
+  free_scene(&scene);
+  free(primary);
+  free(rays);
+  free(objects);
+  return 0;
+}
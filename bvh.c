@@ -0,0 +1,791 @@
+/*==================[inclusions]============================================*/
+
+#include "raytracer.h"
+
+/*==================[macros]================================================*/
+/*==================[type definitions]======================================*/
+
+typedef struct
+{
+  AABB bounds;
+  uint count;
+} Bin;
+
+typedef struct
+{
+  BVH *bvh;
+  const AABB *bounds;
+  vec3 *centroids;
+} BuildContext;
+
+/* packet rays transposed so the slab test vectorizes across lanes */
+typedef struct
+{
+  REAL origin[3][PACKET_SIZE];
+  REAL inv_dir[3][PACKET_SIZE];
+  REAL t_max[PACKET_SIZE];
+} PacketRays;
+
+/*==================[external function declarations]========================*/
+/*==================[internal function declarations]========================*/
+
+static double axis_of(vec3 v, int axis);
+static AABB aabb_grow(AABB box, vec3 p);
+static REAL intersect_aabb(const AABB *box, const Ray *ray, vec3 inv_dir, REAL t_max);
+static uint intersect_packet_aabb(const AABB *box, const PacketRays *packet);
+
+static void build_sah(BVH *bvh, const AABB *bounds, size_t n);
+static void build_lbvh(BVH *bvh, const AABB *bounds, size_t n);
+
+static void update_node_bounds(BuildContext *ctx, uint node_index);
+static void subdivide(BuildContext *ctx, uint node_index);
+static double find_best_split(BuildContext *ctx, const BVHNode *node, int *axis, int *split, AABB *centroid_bounds);
+static int bin_index(double c, double min, double scale);
+
+static AABB refit_node(BVH *bvh, uint node_index, const AABB *bounds);
+
+static uint64_t expand_bits(uint64_t v);
+static int common_prefix(const uint64_t *codes, int64_t n, int64_t i, int64_t j);
+
+/*==================[external constants]====================================*/
+/*==================[internal constants]====================================*/
+/*==================[external data]=========================================*/
+/*==================[internal data]=========================================*/
+/*==================[external function definitions]=========================*/
+
+AABB aabb_empty()
+{
+  return (AABB){VECTOR(REAL_MAX, REAL_MAX, REAL_MAX), VECTOR(-REAL_MAX, -REAL_MAX, -REAL_MAX)};
+}
+
+AABB aabb_union(AABB a, AABB b)
+{
+  return (AABB){vec3_min(a.min, b.min), vec3_max(a.max, b.max)};
+}
+
+double aabb_area(AABB box)
+{
+  vec3 e = vec3_sub(box.max, box.min);
+  if (e.x < 0 || e.y < 0 || e.z < 0)
+    return 0;
+  return 2.0 * (e.x * e.y + e.y * e.z + e.z * e.x);
+}
+
+void bvh_build(BVH *bvh, const AABB *bounds, size_t n, BVHBuilder builder)
+{
+  bvh->num_nodes = 0;
+  bvh->num_indices = n;
+  bvh->nodes = NULL;
+  bvh->indices = NULL;
+  bvh->build_cost = 0;
+  bvh->mapping = NULL;
+  bvh->mapping_size = 0;
+
+  if (n == 0)
+    return;
+
+  bvh->nodes = malloc(sizeof(*bvh->nodes) * (2 * n - 1));
+  bvh->indices = malloc(sizeof(*bvh->indices) * n);
+  assert(bvh->nodes != NULL && bvh->indices != NULL);
+
+  switch (builder)
+  {
+  case BVH_LBVH:
+    build_lbvh(bvh, bounds, n);
+    break;
+  case BVH_SAH:
+  default:
+    build_sah(bvh, bounds, n);
+    break;
+  }
+
+  bvh->build_cost = bvh_cost(bvh);
+}
+
+/* bounds are indexed like the primitives passed to bvh_build(), topology stays untouched */
+void bvh_refit(BVH *bvh, const AABB *bounds)
+{
+  if (bvh->num_nodes > 0)
+    refit_node(bvh, 0, bounds);
+}
+
+/* expected cost of a random ray hitting the root, relative to the root surface area */
+double bvh_cost(const BVH *bvh)
+{
+  if (bvh->num_nodes == 0)
+    return 0;
+
+  double root_area = aabb_area(bvh->nodes[0].bounds);
+  if (root_area <= 0)
+    return 0;
+
+  double cost = 0;
+  for (uint i = 0; i < bvh->num_nodes; i++)
+  {
+    const BVHNode *node = &bvh->nodes[i];
+    double area = aabb_area(node->bounds);
+    cost += node->count > 0 ? BVH_INTERSECT_COST * node->count * area : BVH_TRAVERSAL_COST * area;
+  }
+  return cost / root_area;
+}
+
+void bvh_free(BVH *bvh)
+{
+  if (bvh->mapping != NULL)
+  {
+    bvh_cache_unmap(bvh);
+  }
+  else
+  {
+    free(bvh->nodes);
+    free(bvh->indices);
+  }
+  bvh->nodes = NULL;
+  bvh->indices = NULL;
+  bvh->num_nodes = bvh->num_indices = 0;
+  bvh->build_cost = 0;
+}
+
+bool bvh_intersect(const BVH *bvh, const Ray *ray, IntersectPrimitives intersect_primitives, const void *data, Hit *hit, bool any_hit)
+{
+  if (bvh->num_nodes == 0)
+    return false;
+
+  vec3 inv_dir = {1.0 / ray->direction.x, 1.0 / ray->direction.y, 1.0 / ray->direction.z};
+
+  uint stack[BVH_STACK_SIZE];
+  REAL stack_t[BVH_STACK_SIZE];
+  uint sp = 0;
+  bool found = false;
+
+  if (intersect_aabb(&bvh->nodes[0].bounds, ray, inv_dir, hit->t) == REAL_MAX)
+    return false;
+
+  stack[sp] = 0;
+  stack_t[sp++] = 0;
+
+  while (sp > 0)
+  {
+    sp--;
+    if (stack_t[sp] >= hit->t)
+      continue;
+
+    const BVHNode *node = &bvh->nodes[stack[sp]];
+
+    if (node->count > 0)
+    {
+      if (intersect_primitives(ray, &bvh->indices[node->left_first], node->count, data, hit))
+      {
+        if (any_hit)
+          return true;
+        found = true;
+      }
+      continue;
+    }
+
+    uint near = node->left_first, far = node->left_first + 1;
+    REAL t_near = intersect_aabb(&bvh->nodes[near].bounds, ray, inv_dir, hit->t);
+    REAL t_far = intersect_aabb(&bvh->nodes[far].bounds, ray, inv_dir, hit->t);
+
+    if (t_near > t_far)
+    {
+      uint tmp = near; near = far; far = tmp;
+      REAL tmp_t = t_near; t_near = t_far; t_far = tmp_t;
+    }
+
+    /* push far child first so the near one is popped next */
+    assert(sp + 2 <= BVH_STACK_SIZE);
+    if (t_far != REAL_MAX)
+    {
+      stack[sp] = far;
+      stack_t[sp++] = t_far;
+    }
+    if (t_near != REAL_MAX)
+    {
+      stack[sp] = near;
+      stack_t[sp++] = t_near;
+    }
+  }
+
+  return found;
+}
+
+/*
+ * Traces up to PACKET_SIZE rays through the hierarchy together. Lanes not
+ * set in active are ignored. Nodes are tested against all lanes at once
+ * and a subtree is skipped as soon as no lane overlaps its box. Leaves
+ * run the primitive test per ray. Returns the mask of lanes that hit.
+ */
+uint bvh_intersect_packet(const BVH *bvh, const Ray *rays, uint active, IntersectPrimitives intersect_primitives, const void *data, Hit *hits)
+{
+  if (bvh->num_nodes == 0 || active == 0)
+    return 0;
+
+  PacketRays packet;
+  for (int i = 0; i < PACKET_SIZE; i++)
+  {
+    const Ray *ray = &rays[(active >> i) & 1 ? i : __builtin_ctz(active)];
+    packet.origin[0][i] = ray->origin.x;
+    packet.origin[1][i] = ray->origin.y;
+    packet.origin[2][i] = ray->origin.z;
+    packet.inv_dir[0][i] = 1.0 / ray->direction.x;
+    packet.inv_dir[1][i] = 1.0 / ray->direction.y;
+    packet.inv_dir[2][i] = 1.0 / ray->direction.z;
+    /* inactive lanes can never overlap a box */
+    packet.t_max[i] = (active >> i) & 1 ? hits[i].t : -REAL_MAX;
+  }
+
+  uint stack[BVH_STACK_SIZE];
+  uint sp = 0;
+  uint found = 0;
+
+  stack[sp++] = 0;
+
+  while (sp > 0)
+  {
+    const BVHNode *node = &bvh->nodes[stack[--sp]];
+    uint mask = intersect_packet_aabb(&node->bounds, &packet);
+
+    /* the whole packet missed or already hit something closer */
+    if (mask == 0)
+      continue;
+
+    if (node->count > 0)
+    {
+      for (uint lanes = mask; lanes != 0; lanes &= lanes - 1)
+      {
+        int i = __builtin_ctz(lanes);
+        if (intersect_primitives(&rays[i], &bvh->indices[node->left_first], node->count, data, &hits[i]))
+        {
+          found |= 1u << i;
+          packet.t_max[i] = hits[i].t;
+        }
+      }
+      continue;
+    }
+
+    /* visit the child nearer to the first active lane first */
+    int lead = __builtin_ctz(mask);
+    uint near = node->left_first, far = node->left_first + 1;
+    vec3 a = vec3_add(bvh->nodes[near].bounds.min, bvh->nodes[near].bounds.max);
+    vec3 b = vec3_add(bvh->nodes[far].bounds.min, bvh->nodes[far].bounds.max);
+    if (vec3_dot(vec3_sub(a, b), rays[lead].direction) > 0)
+    {
+      uint tmp = near; near = far; far = tmp;
+    }
+
+    assert(sp + 2 <= BVH_STACK_SIZE);
+    stack[sp++] = far;
+    stack[sp++] = near;
+  }
+
+  return found;
+}
+
+/*==================[internal function definitions]=========================*/
+
+void build_sah(BVH *bvh, const AABB *bounds, size_t n)
+{
+  vec3 *centroids = malloc(sizeof(*centroids) * n);
+  assert(centroids != NULL);
+
+  for (uint i = 0; i < n; i++)
+  {
+    bvh->indices[i] = i;
+    centroids[i] = vec3_scalar_mult(vec3_add(bounds[i].min, bounds[i].max), 0.5);
+  }
+
+  BuildContext ctx = {bvh, bounds, centroids};
+
+  BVHNode *root = &bvh->nodes[bvh->num_nodes++];
+  root->left_first = 0;
+  root->count = n;
+  update_node_bounds(&ctx, 0);
+  subdivide(&ctx, 0);
+
+  free(centroids);
+}
+
+/*
+ * Karras, "Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees" (2012).
+ * Internal node i stores its children in slots 2i+1 and 2i+2, which keeps the sibling
+ * pairs adjacent as bvh_intersect() expects. Each leaf holds exactly one primitive.
+ */
+void build_lbvh(BVH *bvh, const AABB *bounds, size_t n)
+{
+  bvh->num_nodes = 2 * n - 1;
+
+  if (n == 1)
+  {
+    bvh->indices[0] = 0;
+    bvh->nodes[0] = (BVHNode){bounds[0], 0, 1};
+    return;
+  }
+
+  uint64_t *codes = malloc(sizeof(*codes) * n);
+  uint *leaf_slot = malloc(sizeof(*leaf_slot) * n);
+  uint *internal_slot = malloc(sizeof(*internal_slot) * (n - 1));
+  uint *parent = malloc(sizeof(*parent) * bvh->num_nodes);
+  int *visits = calloc(bvh->num_nodes, sizeof(*visits));
+  assert(codes != NULL && leaf_slot != NULL && internal_slot != NULL && parent != NULL && visits != NULL);
+
+  /* quantize centroids relative to the centroid bounds */
+  double min_x = DBL_MAX, min_y = DBL_MAX, min_z = DBL_MAX;
+  double max_x = -DBL_MAX, max_y = -DBL_MAX, max_z = -DBL_MAX;
+
+  #pragma omp parallel for reduction(min:min_x, min_y, min_z) reduction(max:max_x, max_y, max_z)
+  for (int64_t i = 0; i < (int64_t)n; i++)
+  {
+    vec3 c = vec3_scalar_mult(vec3_add(bounds[i].min, bounds[i].max), 0.5);
+    min_x = MIN(min_x, c.x), min_y = MIN(min_y, c.y), min_z = MIN(min_z, c.z);
+    max_x = MAX(max_x, c.x), max_y = MAX(max_y, c.y), max_z = MAX(max_z, c.z);
+  }
+
+  vec3 origin = {min_x, min_y, min_z};
+  vec3 extent = {max_x - min_x, max_y - min_y, max_z - min_z};
+  vec3 scale = {
+    extent.x > 0 ? 1.0 / extent.x : 0,
+    extent.y > 0 ? 1.0 / extent.y : 0,
+    extent.z > 0 ? 1.0 / extent.z : 0,
+  };
+
+  #pragma omp parallel for
+  for (int64_t i = 0; i < (int64_t)n; i++)
+  {
+    vec3 c = vec3_scalar_mult(vec3_add(bounds[i].min, bounds[i].max), 0.5);
+    codes[i] = morton_code(vec3_mult(vec3_sub(c, origin), scale));
+    bvh->indices[i] = i;
+  }
+
+  radix_sort(codes, bvh->indices, n);
+
+  /* emit hierarchy, every internal node is independent of the others */
+  internal_slot[0] = 0;
+
+  #pragma omp parallel for
+  for (int64_t i = 0; i < (int64_t)n - 1; i++)
+  {
+    int d = common_prefix(codes, n, i, i + 1) - common_prefix(codes, n, i, i - 1) > 0 ? 1 : -1;
+
+    /* upper bound for the length of the range */
+    int min_prefix = common_prefix(codes, n, i, i - d);
+    int64_t max_length = 2;
+    while (common_prefix(codes, n, i, i + max_length * d) > min_prefix)
+      max_length *= 2;
+
+    /* find the other end by binary search */
+    int64_t length = 0;
+    for (int64_t t = max_length / 2; t >= 1; t /= 2)
+    {
+      if (common_prefix(codes, n, i, i + (length + t) * d) > min_prefix)
+        length += t;
+    }
+    int64_t j = i + length * d;
+
+    /* find the split position by binary search */
+    int node_prefix = common_prefix(codes, n, i, j);
+    int64_t split = 0, step = length;
+    do
+    {
+      step = (step + 1) / 2;
+      if (common_prefix(codes, n, i, i + (split + step) * d) > node_prefix)
+        split += step;
+    } while (step > 1);
+
+    int64_t gamma = i + split * d + MIN(d, 0);
+    uint left = 2 * i + 1, right = 2 * i + 2;
+
+    if (MIN(i, j) == gamma)
+    {
+      bvh->nodes[left] = (BVHNode){.left_first = gamma, .count = 1};
+      leaf_slot[gamma] = left;
+    }
+    else
+    {
+      bvh->nodes[left] = (BVHNode){.left_first = 2 * gamma + 1, .count = 0};
+      internal_slot[gamma] = left;
+    }
+
+    if (MAX(i, j) == gamma + 1)
+    {
+      bvh->nodes[right] = (BVHNode){.left_first = gamma + 1, .count = 1};
+      leaf_slot[gamma + 1] = right;
+    }
+    else
+    {
+      bvh->nodes[right] = (BVHNode){.left_first = 2 * (gamma + 1) + 1, .count = 0};
+      internal_slot[gamma + 1] = right;
+    }
+  }
+
+  bvh->nodes[0].left_first = 1;
+  bvh->nodes[0].count = 0;
+
+  #pragma omp parallel for
+  for (int64_t i = 0; i < (int64_t)n - 1; i++)
+  {
+    parent[2 * i + 1] = internal_slot[i];
+    parent[2 * i + 2] = internal_slot[i];
+  }
+
+  /* fit bounds bottom-up, the second child to arrive at a node merges both */
+  #pragma omp parallel for
+  for (int64_t k = 0; k < (int64_t)n; k++)
+  {
+    uint slot = leaf_slot[k];
+    bvh->nodes[slot].bounds = bounds[bvh->indices[k]];
+
+    while (slot != 0)
+    {
+      uint p = parent[slot];
+      int arrived;
+
+      #pragma omp flush
+      #pragma omp atomic capture
+      arrived = visits[p]++;
+
+      if (arrived == 0)
+        break;
+
+      #pragma omp flush
+      BVHNode *node = &bvh->nodes[p];
+      node->bounds = aabb_union(bvh->nodes[node->left_first].bounds, bvh->nodes[node->left_first + 1].bounds);
+      slot = p;
+    }
+  }
+
+  free(codes);
+  free(leaf_slot);
+  free(internal_slot);
+  free(parent);
+  free(visits);
+}
+
+double axis_of(vec3 v, int axis)
+{
+  return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+AABB aabb_grow(AABB box, vec3 p)
+{
+  return (AABB){vec3_min(box.min, p), vec3_max(box.max, p)};
+}
+
+/* slab test, returns entry distance or REAL_MAX on miss */
+REAL intersect_aabb(const AABB *box, const Ray *ray, vec3 inv_dir, REAL t_max)
+{
+  REAL tx1 = (box->min.x - ray->origin.x) * inv_dir.x, tx2 = (box->max.x - ray->origin.x) * inv_dir.x;
+  REAL tmin = MIN(tx1, tx2), tmax = MAX(tx1, tx2);
+  REAL ty1 = (box->min.y - ray->origin.y) * inv_dir.y, ty2 = (box->max.y - ray->origin.y) * inv_dir.y;
+  tmin = MAX(tmin, MIN(ty1, ty2)), tmax = MIN(tmax, MAX(ty1, ty2));
+  REAL tz1 = (box->min.z - ray->origin.z) * inv_dir.z, tz2 = (box->max.z - ray->origin.z) * inv_dir.z;
+  tmin = MAX(tmin, MIN(tz1, tz2)), tmax = MIN(tmax, MAX(tz1, tz2));
+
+  if (tmax >= tmin && tmin < t_max && tmax > 0)
+    return MAX(tmin, 0);
+  else
+    return REAL_MAX;
+}
+
+/* same test as intersect_aabb() for every lane, returns the mask of lanes that overlap */
+uint intersect_packet_aabb(const AABB *box, const PacketRays *packet)
+{
+  int overlap[PACKET_SIZE];
+
+  #pragma omp simd
+  for (int i = 0; i < PACKET_SIZE; i++)
+  {
+    REAL tx1 = (box->min.x - packet->origin[0][i]) * packet->inv_dir[0][i], tx2 = (box->max.x - packet->origin[0][i]) * packet->inv_dir[0][i];
+    REAL tmin = MIN(tx1, tx2), tmax = MAX(tx1, tx2);
+    REAL ty1 = (box->min.y - packet->origin[1][i]) * packet->inv_dir[1][i], ty2 = (box->max.y - packet->origin[1][i]) * packet->inv_dir[1][i];
+    tmin = MAX(tmin, MIN(ty1, ty2)), tmax = MIN(tmax, MAX(ty1, ty2));
+    REAL tz1 = (box->min.z - packet->origin[2][i]) * packet->inv_dir[2][i], tz2 = (box->max.z - packet->origin[2][i]) * packet->inv_dir[2][i];
+    tmin = MAX(tmin, MIN(tz1, tz2)), tmax = MIN(tmax, MAX(tz1, tz2));
+
+    overlap[i] = tmax >= tmin && tmin < packet->t_max[i] && tmax > 0;
+  }
+
+  uint mask = 0;
+  for (int i = 0; i < PACKET_SIZE; i++)
+    mask |= (uint)overlap[i] << i;
+  return mask;
+}
+
+AABB refit_node(BVH *bvh, uint node_index, const AABB *bounds)
+{
+  BVHNode *node = &bvh->nodes[node_index];
+
+  if (node->count > 0)
+  {
+    node->bounds = aabb_empty();
+    for (uint i = 0; i < node->count; i++)
+      node->bounds = aabb_union(node->bounds, bounds[bvh->indices[node->left_first + i]]);
+  }
+  else
+  {
+    AABB left = refit_node(bvh, node->left_first, bounds);
+    AABB right = refit_node(bvh, node->left_first + 1, bounds);
+    node->bounds = aabb_union(left, right);
+  }
+
+  return node->bounds;
+}
+
+void update_node_bounds(BuildContext *ctx, uint node_index)
+{
+  BVHNode *node = &ctx->bvh->nodes[node_index];
+  node->bounds = aabb_empty();
+  for (uint i = 0; i < node->count; i++)
+  {
+    uint prim = ctx->bvh->indices[node->left_first + i];
+    node->bounds = aabb_union(node->bounds, ctx->bounds[prim]);
+  }
+}
+
+int bin_index(double c, double min, double scale)
+{
+  return MIN(BVH_NUM_BINS - 1, (int)((c - min) * scale));
+}
+
+/* spreads the lower 21 bits so there are two zero bits between each of them */
+uint64_t expand_bits(uint64_t v)
+{
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffffULL;
+  v = (v | v << 16) & 0x1f0000ff0000ffULL;
+  v = (v | v << 8) & 0x100f00f00f00f00fULL;
+  v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+  v = (v | v << 2) & 0x1249249249249249ULL;
+  return v;
+}
+
+/* p is expected in [0, 1]^3 */
+uint64_t morton_code(vec3 p)
+{
+  const double s = (double)((1 << MORTON_BITS) - 1);
+  uint64_t x = (uint64_t)(CLAMP(p.x) * s);
+  uint64_t y = (uint64_t)(CLAMP(p.y) * s);
+  uint64_t z = (uint64_t)(CLAMP(p.z) * s);
+  return (expand_bits(x) << 2) | (expand_bits(y) << 1) | expand_bits(z);
+}
+
+/* parallel LSD radix sort of (key, value) pairs, 8 bits per pass, digits all keys share are skipped */
+void radix_sort(uint64_t *keys, uint *values, size_t n)
+{
+  const int radix = 256;
+  int max_threads = omp_get_max_threads();
+  uint64_t *const out_keys = keys;
+  uint *const out_values = values;
+
+  uint64_t varying = 0;
+  #pragma omp parallel for reduction(|:varying)
+  for (int64_t i = 0; i < (int64_t)n; i++)
+    varying |= keys[i] ^ keys[0];
+
+  uint64_t *tmp_keys = malloc(sizeof(*tmp_keys) * n);
+  uint *tmp_values = malloc(sizeof(*tmp_values) * n);
+  size_t *histograms = malloc(sizeof(*histograms) * radix * max_threads);
+  assert(tmp_keys != NULL && tmp_values != NULL && histograms != NULL);
+
+  for (int shift = 0; shift < 64; shift += 8)
+  {
+    if (((varying >> shift) & 0xff) == 0)
+      continue;
+
+    #pragma omp parallel num_threads(max_threads)
+    {
+      int t = omp_get_thread_num(), num_threads = omp_get_num_threads();
+      size_t begin = n * t / num_threads, end = n * (t + 1) / num_threads;
+      size_t *histogram = &histograms[t * radix];
+
+      memset(histogram, 0, sizeof(*histogram) * radix);
+      for (size_t i = begin; i < end; i++)
+        histogram[(keys[i] >> shift) & 0xff]++;
+
+      #pragma omp barrier
+      #pragma omp single
+      {
+        /* exclusive prefix sum ordered by digit, then by thread */
+        size_t sum = 0;
+        for (int d = 0; d < radix; d++)
+        {
+          for (int u = 0; u < num_threads; u++)
+          {
+            size_t count = histograms[u * radix + d];
+            histograms[u * radix + d] = sum;
+            sum += count;
+          }
+        }
+      }
+
+      for (size_t i = begin; i < end; i++)
+      {
+        size_t pos = histogram[(keys[i] >> shift) & 0xff]++;
+        tmp_keys[pos] = keys[i];
+        tmp_values[pos] = values[i];
+      }
+    }
+
+    uint64_t *swap_keys = keys; keys = tmp_keys; tmp_keys = swap_keys;
+    uint *swap_values = values; values = tmp_values; tmp_values = swap_values;
+  }
+
+  if (keys != out_keys)
+  {
+    memcpy(out_keys, keys, sizeof(*keys) * n);
+    memcpy(out_values, values, sizeof(*values) * n);
+    tmp_keys = keys;
+    tmp_values = values;
+  }
+
+  free(tmp_keys);
+  free(tmp_values);
+  free(histograms);
+}
+
+/* length of the common prefix of two keys, ties are broken by index */
+int common_prefix(const uint64_t *codes, int64_t n, int64_t i, int64_t j)
+{
+  if (j < 0 || j >= n)
+    return -1;
+  if (codes[i] == codes[j])
+    return 64 + __builtin_clzll((uint64_t)(i ^ j));
+  return __builtin_clzll(codes[i] ^ codes[j]);
+}
+
+double find_best_split(BuildContext *ctx, const BVHNode *node, int *axis, int *split, AABB *centroid_bounds)
+{
+  double best_cost = DBL_MAX;
+
+  *centroid_bounds = aabb_empty();
+  for (uint i = 0; i < node->count; i++)
+    *centroid_bounds = aabb_grow(*centroid_bounds, ctx->centroids[ctx->bvh->indices[node->left_first + i]]);
+
+  for (int a = 0; a < 3; a++)
+  {
+    double min = axis_of(centroid_bounds->min, a), max = axis_of(centroid_bounds->max, a);
+    if (min == max)
+      continue;
+
+    Bin bins[BVH_NUM_BINS];
+    for (int b = 0; b < BVH_NUM_BINS; b++)
+      bins[b] = (Bin){aabb_empty(), 0};
+
+    double scale = BVH_NUM_BINS / (max - min);
+    for (uint i = 0; i < node->count; i++)
+    {
+      uint prim = ctx->bvh->indices[node->left_first + i];
+      Bin *bin = &bins[bin_index(axis_of(ctx->centroids[prim], a), min, scale)];
+      bin->count++;
+      bin->bounds = aabb_union(bin->bounds, ctx->bounds[prim]);
+    }
+
+    /* sweep from both sides to get the cost of every bin plane */
+    double left_area[BVH_NUM_BINS - 1], right_area[BVH_NUM_BINS - 1];
+    uint left_count[BVH_NUM_BINS - 1], right_count[BVH_NUM_BINS - 1];
+    AABB left_box = aabb_empty(), right_box = aabb_empty();
+    uint left_sum = 0, right_sum = 0;
+
+    for (int b = 0; b < BVH_NUM_BINS - 1; b++)
+    {
+      left_sum += bins[b].count;
+      left_count[b] = left_sum;
+      left_box = aabb_union(left_box, bins[b].bounds);
+      left_area[b] = aabb_area(left_box);
+
+      right_sum += bins[BVH_NUM_BINS - 1 - b].count;
+      right_count[BVH_NUM_BINS - 2 - b] = right_sum;
+      right_box = aabb_union(right_box, bins[BVH_NUM_BINS - 1 - b].bounds);
+      right_area[BVH_NUM_BINS - 2 - b] = aabb_area(right_box);
+    }
+
+    for (int b = 0; b < BVH_NUM_BINS - 1; b++)
+    {
+      if (left_count[b] == 0 || right_count[b] == 0)
+        continue;
+
+      double cost = left_count[b] * left_area[b] + right_count[b] * right_area[b];
+      if (cost < best_cost)
+      {
+        best_cost = cost;
+        *axis = a;
+        *split = b + 1;
+      }
+    }
+  }
+
+  return best_cost;
+}
+
+void subdivide(BuildContext *ctx, uint node_index)
+{
+  BVHNode *node = &ctx->bvh->nodes[node_index];
+
+  if (node->count <= 1)
+    return;
+
+  int axis = -1, split = 0;
+  AABB centroid_bounds;
+  double best_cost = find_best_split(ctx, node, &axis, &split, &centroid_bounds);
+
+  int i;
+
+  if (axis < 0)
+  {
+    /* all centroids coincide, halve the range so leaves stay small */
+    if (node->count <= BVH_MAX_LEAF_SIZE)
+      return;
+    i = node->left_first + node->count / 2;
+  }
+  else
+  {
+    double area = aabb_area(node->bounds);
+    double leaf_cost = BVH_INTERSECT_COST * node->count;
+    double split_cost = area > 0 ? BVH_TRAVERSAL_COST + BVH_INTERSECT_COST * best_cost / area : BVH_TRAVERSAL_COST;
+
+    if (node->count <= BVH_MAX_LEAF_SIZE && split_cost >= leaf_cost)
+      return;
+
+    /* partition indices in place */
+    double min = axis_of(centroid_bounds.min, axis), max = axis_of(centroid_bounds.max, axis);
+    double scale = BVH_NUM_BINS / (max - min);
+    uint *indices = ctx->bvh->indices;
+    int j = node->left_first + node->count - 1;
+    i = node->left_first;
+
+    while (i <= j)
+    {
+      if (bin_index(axis_of(ctx->centroids[indices[i]], axis), min, scale) < split)
+      {
+        i++;
+      }
+      else
+      {
+        uint tmp = indices[i];
+        indices[i] = indices[j];
+        indices[j--] = tmp;
+      }
+    }
+  }
+
+  uint left_count = i - node->left_first;
+  assert(left_count > 0 && left_count < node->count);
+
+  uint left = ctx->bvh->num_nodes;
+  ctx->bvh->num_nodes += 2;
+
+  ctx->bvh->nodes[left].left_first = node->left_first;
+  ctx->bvh->nodes[left].count = left_count;
+  ctx->bvh->nodes[left + 1].left_first = i;
+  ctx->bvh->nodes[left + 1].count = node->count - left_count;
+
+  node->left_first = left;
+  node->count = 0;
+
+  update_node_bounds(ctx, left);
+  update_node_bounds(ctx, left + 1);
+  subdivide(ctx, left);
+  subdivide(ctx, left + 1);
+}
+
+/*==================[end of file]===========================================*/
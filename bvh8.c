@@ -0,0 +1,370 @@
+/*==================[inclusions]============================================*/
+
+#include "raytracer.h"
+
+#ifdef HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/*==================[macros]================================================*/
+
+/* widens the float slab interval to cover rounding of the float ray setup */
+#define BVH8_PADDING (1.0f + 4.0f * FLT_EPSILON)
+
+/*==================[type definitions]======================================*/
+
+typedef struct
+{
+  float origin[3];
+  float inv_dir[3];
+} FloatRay;
+
+typedef uint (*IntersectChildren)(const BVH8Node *node, const FloatRay *ray, float t_max, float *t_near);
+
+/*==================[external function declarations]========================*/
+/*==================[internal function declarations]========================*/
+
+static void collapse(BVH8 *wide, const BVH *bvh, uint wide_index, uint node_index);
+static void quantize(BVH8Node *node, int slot, AABB parent, AABB child);
+static inline __attribute__((always_inline)) bool traverse(const BVH8 *wide, const Ray *ray, IntersectChildren intersect_children, IntersectPrimitives intersect_primitives, const void *data, Hit *hit, bool any_hit);
+static uint intersect_children_scalar(const BVH8Node *node, const FloatRay *ray, float t_max, float *t_near);
+#ifdef HAVE_X86_KERNELS
+static TARGET_AVX2 uint intersect_children_avx2(const BVH8Node *node, const FloatRay *ray, float t_max, float *t_near);
+#endif
+
+/*==================[external constants]====================================*/
+/*==================[internal constants]====================================*/
+/*==================[external data]=========================================*/
+/*==================[internal data]=========================================*/
+/*==================[external function definitions]=========================*/
+
+void bvh8_build(BVH8 *wide, const BVH *bvh)
+{
+  wide->num_nodes = 0;
+  wide->num_indices = 0;
+  wide->nodes = NULL;
+  wide->indices = NULL;
+
+  if (bvh->num_nodes == 0)
+    return;
+
+  /* every wide node except a leaf root swallows at least one binary interior node */
+  wide->nodes = malloc(sizeof(*wide->nodes) * (bvh->num_nodes / 2 + 1));
+  wide->indices = malloc(sizeof(*wide->indices) * bvh->num_indices);
+  assert(wide->nodes != NULL && wide->indices != NULL);
+
+  wide->num_nodes = 1;
+  collapse(wide, bvh, 0, 0);
+  assert(wide->num_indices == bvh->num_indices);
+}
+
+void bvh8_free(BVH8 *wide)
+{
+  free(wide->nodes);
+  free(wide->indices);
+  wide->nodes = NULL;
+  wide->indices = NULL;
+  wide->num_nodes = wide->num_indices = 0;
+}
+
+bool bvh8_intersect_scalar(const BVH8 *wide, const Ray *ray, IntersectPrimitives intersect_primitives, const void *data, Hit *hit, bool any_hit)
+{
+  return traverse(wide, ray, &intersect_children_scalar, intersect_primitives, data, hit, any_hit);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+TARGET_AVX2 bool bvh8_intersect_avx2(const BVH8 *wide, const Ray *ray, IntersectPrimitives intersect_primitives, const void *data, Hit *hit, bool any_hit)
+{
+  return traverse(wide, ray, &intersect_children_avx2, intersect_primitives, data, hit, any_hit);
+}
+
+#endif
+
+/* runs the variant init_kernels() picked for this CPU */
+bool bvh8_intersect(const BVH8 *wide, const Ray *ray, IntersectPrimitives intersect_primitives, const void *data, Hit *hit, bool any_hit)
+{
+  return kernels.bvh8_intersect(wide, ray, intersect_primitives, data, hit, any_hit);
+}
+
+/*==================[internal function definitions]=========================*/
+
+/* inlined into every variant so the child test is inlined as well */
+bool traverse(const BVH8 *wide, const Ray *ray, IntersectChildren intersect_children, IntersectPrimitives intersect_primitives, const void *data, Hit *hit, bool any_hit)
+{
+  if (wide->num_nodes == 0)
+    return false;
+
+  FloatRay fray;
+  const double d[3] = {ray->direction.x, ray->direction.y, ray->direction.z};
+  fray.origin[0] = ray->origin.x;
+  fray.origin[1] = ray->origin.y;
+  fray.origin[2] = ray->origin.z;
+  for (int a = 0; a < 3; a++)
+  {
+    /* avoid 0 * inf in the slab test for axis aligned rays */
+    float di = fabs(d[a]) < FLT_MIN ? (d[a] < 0 ? -FLT_MIN : FLT_MIN) : (float)d[a];
+    fray.inv_dir[a] = 1.0f / di;
+  }
+
+  uint stack[BVH_STACK_SIZE];
+  float stack_t[BVH_STACK_SIZE];
+  uint sp = 0;
+  bool found = false;
+
+  stack[sp] = 0;
+  stack_t[sp++] = 0;
+
+  while (sp > 0)
+  {
+    sp--;
+    if (stack_t[sp] >= hit->t)
+      continue;
+
+    const BVH8Node *node = &wide->nodes[stack[sp]];
+    float t_max = hit->t > FLT_MAX ? INFINITY : (float)hit->t;
+    float t_near[BVH8_WIDTH];
+    uint mask = intersect_children(node, &fray, t_max, t_near);
+
+    /* leaves first and near to far, they may shorten the ray before children are pushed */
+    uint leaves[BVH8_WIDTH], offsets[BVH8_WIDTH], num_leaves = 0, offset = 0;
+    for (int i = 0; i < BVH8_WIDTH; i++)
+    {
+      if ((mask >> i) & 1 && node->count[i] > 0)
+      {
+        uint j = num_leaves++;
+        while (j > 0 && t_near[leaves[j - 1]] > t_near[i])
+        {
+          leaves[j] = leaves[j - 1];
+          offsets[j] = offsets[j - 1];
+          j--;
+        }
+        leaves[j] = i;
+        offsets[j] = offset;
+      }
+      offset += node->count[i];
+    }
+
+    for (uint l = 0; l < num_leaves && t_near[leaves[l]] < hit->t; l++)
+    {
+      if (intersect_primitives(ray, &wide->indices[node->primitive_base + offsets[l]], node->count[leaves[l]], data, hit))
+      {
+        if (any_hit)
+          return true;
+        found = true;
+      }
+    }
+
+    /* push interior children far to near so the nearest is popped first */
+    uint internal = mask & node->internal_mask;
+    uint child = node->child_base, first = sp;
+    for (int i = 0; i < BVH8_WIDTH; i++)
+    {
+      if (!((node->internal_mask >> i) & 1))
+        continue;
+
+      if ((internal >> i) & 1 && t_near[i] < hit->t)
+      {
+        assert(sp < BVH_STACK_SIZE);
+        uint j = sp++;
+        while (j > first && stack_t[j - 1] < t_near[i])
+        {
+          stack[j] = stack[j - 1];
+          stack_t[j] = stack_t[j - 1];
+          j--;
+        }
+        stack[j] = child;
+        stack_t[j] = t_near[i];
+      }
+      child++;
+    }
+  }
+
+  return found;
+}
+
+/* greedily opens the largest interior child until there are eight children */
+void collapse(BVH8 *wide, const BVH *bvh, uint wide_index, uint node_index)
+{
+  uint children[BVH8_WIDTH];
+  int n = 0;
+  const BVHNode *root = &bvh->nodes[node_index];
+
+  if (root->count > 0)
+  {
+    children[n++] = node_index;
+  }
+  else
+  {
+    children[n++] = root->left_first;
+    children[n++] = root->left_first + 1;
+  }
+
+  while (n < BVH8_WIDTH)
+  {
+    int best = -1;
+    double best_area = -1;
+    for (int i = 0; i < n; i++)
+    {
+      const BVHNode *c = &bvh->nodes[children[i]];
+      double area = aabb_area(c->bounds);
+      if (c->count == 0 && area > best_area)
+      {
+        best = i;
+        best_area = area;
+      }
+    }
+
+    if (best < 0)
+      break;
+
+    uint opened = children[best];
+    children[best] = bvh->nodes[opened].left_first;
+    children[n++] = bvh->nodes[opened].left_first + 1;
+  }
+
+  BVH8Node *node = &wide->nodes[wide_index];
+  memset(node, 0, sizeof(*node));
+
+  AABB parent = root->bounds;
+  for (int a = 0; a < 3; a++)
+  {
+    double min = a == 0 ? parent.min.x : (a == 1 ? parent.min.y : parent.min.z);
+    double max = a == 0 ? parent.max.x : (a == 1 ? parent.max.y : parent.max.z);
+
+    /* round the origin down so the grid starts below the node box */
+    float origin = (float)min;
+    if (origin > min)
+      origin = nextafterf(origin, -INFINITY);
+
+    int e = (max - origin) > 0 ? (int)ceil(log2((max - origin) / 255.0)) : 0;
+    e = MAX(-127, MIN(127, e));
+    while (e < 127 && ldexp(255.0, e) + origin < max)
+      e++;
+
+    node->origin[a] = origin;
+    node->exponent[a] = (int8_t)e;
+  }
+
+  int num_internal = 0;
+  for (int i = 0; i < n; i++)
+    num_internal += bvh->nodes[children[i]].count == 0;
+
+  node->child_base = wide->num_nodes;
+  node->primitive_base = wide->num_indices;
+  wide->num_nodes += num_internal;
+
+  for (int i = 0; i < n; i++)
+  {
+    const BVHNode *c = &bvh->nodes[children[i]];
+    quantize(node, i, parent, c->bounds);
+
+    if (c->count > 0)
+    {
+      assert(c->count <= 255);
+      node->count[i] = c->count;
+      memcpy(&wide->indices[wide->num_indices], &bvh->indices[c->left_first], sizeof(uint) * c->count);
+      wide->num_indices += c->count;
+    }
+    else
+    {
+      node->internal_mask |= 1 << i;
+    }
+  }
+
+  uint child = node->child_base;
+  for (int i = 0; i < n; i++)
+  {
+    if (bvh->nodes[children[i]].count == 0)
+      collapse(wide, bvh, child++, children[i]);
+  }
+}
+
+/* conservative quantization, the decoded float box always contains the child box */
+void quantize(BVH8Node *node, int slot, AABB parent, AABB child)
+{
+  double lo[3] = {child.min.x, child.min.y, child.min.z};
+  double hi[3] = {child.max.x, child.max.y, child.max.z};
+
+  for (int a = 0; a < 3; a++)
+  {
+    double origin = node->origin[a];
+    double step = ldexp(1.0, node->exponent[a]);
+
+    /* clamped before the conversion, huge boxes would not fit an int */
+    int qmin = (int)MAX(0.0, MIN(255.0, floor((lo[a] - origin) / step)));
+    int qmax = (int)MAX(0.0, MIN(255.0, ceil((hi[a] - origin) / step)));
+
+    while (qmin > 0 && (float)(origin + qmin * step) > lo[a])
+      qmin--;
+    while (qmax < 255 && (float)(origin + qmax * step) < hi[a])
+      qmax++;
+
+    node->qmin[a][slot] = (uint8_t)qmin;
+    node->qmax[a][slot] = (uint8_t)qmax;
+  }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* one 8-wide slab test against all child boxes of the node */
+TARGET_AVX2 uint intersect_children_avx2(const BVH8Node *node, const FloatRay *ray, float t_max, float *t_near)
+{
+  __m256 tmin = _mm256_setzero_ps();
+  __m256 tmax = _mm256_set1_ps(t_max);
+
+  for (int a = 0; a < 3; a++)
+  {
+    __m256 step = _mm256_set1_ps(ldexpf(1.0f, node->exponent[a]));
+    __m256 origin = _mm256_set1_ps(node->origin[a] - ray->origin[a]);
+    __m256 inv_dir = _mm256_set1_ps(ray->inv_dir[a]);
+
+    __m256 qmin = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)node->qmin[a])));
+    __m256 qmax = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)node->qmax[a])));
+
+    __m256 t0 = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(qmin, step), origin), inv_dir);
+    __m256 t1 = _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(qmax, step), origin), inv_dir);
+
+    tmin = _mm256_max_ps(tmin, _mm256_min_ps(t0, t1));
+    tmax = _mm256_min_ps(tmax, _mm256_max_ps(t0, t1));
+  }
+
+  tmax = _mm256_mul_ps(tmax, _mm256_set1_ps(BVH8_PADDING));
+  _mm256_storeu_ps(t_near, tmin);
+
+  __m128i counts = _mm_loadl_epi64((const __m128i *)node->count);
+  uint empty = _mm_movemask_epi8(_mm_cmpeq_epi8(counts, _mm_setzero_si128())) & 0xff;
+  uint valid = node->internal_mask | (~empty & 0xff);
+
+  return _mm256_movemask_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ)) & valid;
+}
+
+#endif
+
+uint intersect_children_scalar(const BVH8Node *node, const FloatRay *ray, float t_max, float *t_near)
+{
+  uint mask = 0;
+
+  for (int i = 0; i < BVH8_WIDTH; i++)
+  {
+    float tmin = 0, tmax = t_max;
+
+    for (int a = 0; a < 3; a++)
+    {
+      float step = ldexpf(1.0f, node->exponent[a]);
+      float origin = node->origin[a] - ray->origin[a];
+      float t0 = (node->qmin[a][i] * step + origin) * ray->inv_dir[a];
+      float t1 = (node->qmax[a][i] * step + origin) * ray->inv_dir[a];
+      tmin = MAX(tmin, MIN(t0, t1));
+      tmax = MIN(tmax, MAX(t0, t1));
+    }
+
+    t_near[i] = tmin;
+    if ((node->count[i] > 0 || (node->internal_mask >> i) & 1) && tmin <= tmax * BVH8_PADDING)
+      mask |= 1 << i;
+  }
+
+  return mask;
+}
+
+/*==================[end of file]===========================================*/
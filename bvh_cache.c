@@ -0,0 +1,196 @@
+/*==================[inclusions]============================================*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "raytracer.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*==================[macros]================================================*/
+
+#define BVH_CACHE_MAGIC   "RTBVH\0\0\0"
+#define BVH_CACHE_VERSION 3   /* bump when BVHNode, the builders or the leaf layout change */
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME  1099511628211ULL
+
+/*==================[type definitions]======================================*/
+
+/* node and index arrays follow the header, the header keeps them 8 byte aligned */
+typedef struct
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t node_size;
+  uint64_t hash;
+  uint64_t num_nodes, num_indices;
+  double build_cost;
+} BVHCacheHeader;
+
+/*==================[external function declarations]========================*/
+/*==================[internal function declarations]========================*/
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t size);
+static bool write_all(int fd, const void *data, size_t size);
+
+/*==================[external constants]====================================*/
+/*==================[internal constants]====================================*/
+/*==================[external data]=========================================*/
+/*==================[internal data]=========================================*/
+/*==================[external function definitions]=========================*/
+
+/* covers everything bvh_build() sees, so equal keys give identical trees */
+uint64_t bvh_cache_key(const AABB *bounds, size_t n, BVHBuilder builder)
+{
+  uint64_t hash = FNV_OFFSET;
+  uint32_t version = BVH_CACHE_VERSION, type = builder;
+  uint64_t count = n;
+
+  /* the build constants shape the leaves as much as the input does */
+  uint32_t leaf_size = BVH_MAX_LEAF_SIZE, bins = BVH_NUM_BINS, morton_bits = MORTON_BITS;
+  double costs[2] = {BVH_TRAVERSAL_COST, BVH_INTERSECT_COST};
+
+  hash = fnv1a(hash, &version, sizeof(version));
+  hash = fnv1a(hash, &type, sizeof(type));
+  hash = fnv1a(hash, &leaf_size, sizeof(leaf_size));
+  hash = fnv1a(hash, &bins, sizeof(bins));
+  hash = fnv1a(hash, &morton_bits, sizeof(morton_bits));
+  hash = fnv1a(hash, costs, sizeof(costs));
+  hash = fnv1a(hash, &count, sizeof(count));
+  return fnv1a(hash, bounds, sizeof(*bounds) * n);
+}
+
+/*
+ * Maps a tree written by bvh_cache_save(). The mapping is private and
+ * writable, so refitting a cached tree only touches copy-on-write pages.
+ * Returns false on a missing, stale or truncated file.
+ */
+bool bvh_cache_load(BVH *bvh, const char *path, uint64_t key)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(BVHCacheHeader))
+  {
+    close(fd);
+    return false;
+  }
+
+  size_t size = st.st_size;
+  void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return false;
+
+  const BVHCacheHeader *header = base;
+  size_t expected = sizeof(*header)
+                  + header->num_nodes * sizeof(BVHNode)
+                  + header->num_indices * sizeof(uint);
+
+  if (memcmp(header->magic, BVH_CACHE_MAGIC, sizeof(header->magic)) != 0
+      || header->version != BVH_CACHE_VERSION
+      || header->node_size != sizeof(BVHNode)
+      || header->hash != key
+      || header->num_nodes == 0
+      || expected != size)
+  {
+    munmap(base, size);
+    return false;
+  }
+
+  bvh->nodes = (BVHNode *)(header + 1);
+  bvh->indices = (uint *)(bvh->nodes + header->num_nodes);
+  bvh->num_nodes = header->num_nodes;
+  bvh->num_indices = header->num_indices;
+  bvh->build_cost = header->build_cost;
+  bvh->mapping = base;
+  bvh->mapping_size = size;
+  return true;
+}
+
+/* writes to a temporary file first so concurrent runs never map a partial tree */
+bool bvh_cache_save(const BVH *bvh, const char *path, uint64_t key)
+{
+  if (bvh->num_nodes == 0)
+    return false;
+
+  char tmp[4096];
+  if (snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid()) >= (int)sizeof(tmp))
+    return false;
+
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return false;
+
+  BVHCacheHeader header = {
+    .version = BVH_CACHE_VERSION,
+    .node_size = sizeof(BVHNode),
+    .hash = key,
+    .num_nodes = bvh->num_nodes,
+    .num_indices = bvh->num_indices,
+    .build_cost = bvh->build_cost,
+  };
+  memcpy(header.magic, BVH_CACHE_MAGIC, sizeof(header.magic));
+
+  bool ok = write_all(fd, &header, sizeof(header))
+         && write_all(fd, bvh->nodes, sizeof(*bvh->nodes) * bvh->num_nodes)
+         && write_all(fd, bvh->indices, sizeof(*bvh->indices) * bvh->num_indices);
+  ok = close(fd) == 0 && ok;
+
+  if (ok)
+    ok = rename(tmp, path) == 0;
+  if (!ok)
+    unlink(tmp);
+  return ok;
+}
+
+void bvh_cache_unmap(BVH *bvh)
+{
+  munmap(bvh->mapping, bvh->mapping_size);
+  bvh->mapping = NULL;
+  bvh->mapping_size = 0;
+}
+
+/*==================[internal function definitions]=========================*/
+
+/* FNV-1a over 64 bit words, the byte tail is mixed in one at a time */
+uint64_t fnv1a(uint64_t hash, const void *data, size_t size)
+{
+  const uint8_t *bytes = data;
+  size_t i = 0;
+
+  for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+  {
+    uint64_t word;
+    memcpy(&word, bytes + i, sizeof(word));
+    hash ^= word;
+    hash *= FNV_PRIME;
+  }
+  for (; i < size; i++)
+  {
+    hash ^= bytes[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+bool write_all(int fd, const void *data, size_t size)
+{
+  const char *p = data;
+  while (size > 0)
+  {
+    ssize_t written = write(fd, p, size);
+    if (written <= 0)
+      return false;
+    p += written;
+    size -= written;
+  }
+  return true;
+}
+
+/*==================[end of file]===========================================*/
@@ -0,0 +1,289 @@
+/*==================[inclusions]============================================*/
+
+#include "raytracer.h"
+
+/*==================[macros]================================================*/
+
+#define GRID_MAILBOX_SIZE 16  /* power of two, recently tested primitives per ray */
+#define GRID_BATCH_SIZE   8   /* primitives per call into the intersection kernel */
+
+/*==================[type definitions]======================================*/
+/*==================[external function declarations]========================*/
+/*==================[internal function declarations]========================*/
+
+static double axis_of(vec3 v, int axis);
+static int compare_double(const void *a, const void *b);
+static void cell_range(const Grid *grid, AABB box, int lo[3], int hi[3]);
+static bool intersect_list(const uint *items, uint count, uint *mailbox, const Ray *ray, IntersectPrimitives intersect_primitives, const void *data, Hit *hit, bool any_hit);
+
+/*==================[external constants]====================================*/
+/*==================[internal constants]====================================*/
+/*==================[external data]=========================================*/
+/*==================[internal data]=========================================*/
+/*==================[external function definitions]=========================*/
+
+/*
+ * Bins every primitive into all cells its box overlaps. Primitives much
+ * larger than the typical one would stretch the grid over mostly empty
+ * space, they are kept in a separate list that every ray tests.
+ */
+void grid_build(Grid *grid, const AABB *bounds, size_t n)
+{
+  memset(grid, 0, sizeof(*grid));
+  if (n == 0)
+    return;
+
+  /* median box diagonal decides what counts as large */
+  double *diagonals = malloc(sizeof(*diagonals) * n);
+  assert(diagonals != NULL);
+  for (uint i = 0; i < n; i++)
+    diagonals[i] = vec3_length(vec3_sub(bounds[i].max, bounds[i].min));
+  qsort(diagonals, n, sizeof(*diagonals), compare_double);
+  double max_diagonal = GRID_LARGE_FACTOR * diagonals[n / 2];
+  free(diagonals);
+
+  grid->large = malloc(sizeof(*grid->large) * n);
+  assert(grid->large != NULL);
+
+  AABB box = aabb_empty();
+  for (uint i = 0; i < n; i++)
+  {
+    if (vec3_length(vec3_sub(bounds[i].max, bounds[i].min)) > max_diagonal)
+      grid->large[grid->num_large++] = i;
+    else
+      box = aabb_union(box, bounds[i]);
+  }
+  grid->bounds = box;
+
+  /* aim for GRID_DENSITY cells per primitive with roughly cubic cells */
+  size_t num_small = n - grid->num_large;
+  vec3 extent = vec3_sub(box.max, box.min);
+  double volume = MAX(extent.x, DBL_MIN) * MAX(extent.y, DBL_MIN) * MAX(extent.z, DBL_MIN);
+  double cells_per_unit = cbrt(GRID_DENSITY * num_small / volume);
+
+  grid->num_cells = 1;
+  for (int a = 0; a < 3; a++)
+  {
+    double e = axis_of(extent, a);
+    int res = num_small > 0 ? (int)ceil(e * cells_per_unit) : 1;
+    grid->res[a] = MAX(1, MIN(GRID_MAX_RESOLUTION, res));
+    grid->num_cells *= grid->res[a];
+  }
+  grid->cell_size = VECTOR(extent.x / grid->res[0], extent.y / grid->res[1], extent.z / grid->res[2]);
+
+  /* two passes, count per cell and then scatter into the prefix summed ranges */
+  grid->cell_start = calloc(grid->num_cells + 1, sizeof(*grid->cell_start));
+  assert(grid->cell_start != NULL);
+
+  for (uint i = 0, l = 0; i < n; i++)
+  {
+    if (l < grid->num_large && grid->large[l] == i)
+    {
+      l++;
+      continue;
+    }
+
+    int lo[3], hi[3];
+    cell_range(grid, bounds[i], lo, hi);
+    for (int z = lo[2]; z <= hi[2]; z++)
+      for (int y = lo[1]; y <= hi[1]; y++)
+        for (int x = lo[0]; x <= hi[0]; x++)
+          grid->cell_start[((size_t)z * grid->res[1] + y) * grid->res[0] + x + 1]++;
+  }
+
+  for (size_t c = 0; c < grid->num_cells; c++)
+    grid->cell_start[c + 1] += grid->cell_start[c];
+  grid->num_items = grid->cell_start[grid->num_cells];
+
+  grid->items = malloc(sizeof(*grid->items) * MAX(grid->num_items, 1));
+  uint *fill = malloc(sizeof(*fill) * grid->num_cells);
+  assert(grid->items != NULL && fill != NULL);
+  memcpy(fill, grid->cell_start, sizeof(*fill) * grid->num_cells);
+
+  for (uint i = 0, l = 0; i < n; i++)
+  {
+    if (l < grid->num_large && grid->large[l] == i)
+    {
+      l++;
+      continue;
+    }
+
+    int lo[3], hi[3];
+    cell_range(grid, bounds[i], lo, hi);
+    for (int z = lo[2]; z <= hi[2]; z++)
+      for (int y = lo[1]; y <= hi[1]; y++)
+        for (int x = lo[0]; x <= hi[0]; x++)
+          grid->items[fill[((size_t)z * grid->res[1] + y) * grid->res[0] + x]++] = i;
+  }
+
+  free(fill);
+}
+
+void grid_free(Grid *grid)
+{
+  free(grid->cell_start);
+  free(grid->items);
+  free(grid->large);
+  memset(grid, 0, sizeof(*grid));
+}
+
+/* 3D-DDA over the cells the ray passes, stops once a hit lies inside the current cell */
+bool grid_intersect(const Grid *grid, const Ray *ray, IntersectPrimitives intersect_primitives, const void *data, Hit *hit, bool any_hit)
+{
+  if (grid->num_cells == 0)
+    return false;
+
+  uint mailbox[GRID_MAILBOX_SIZE];
+  memset(mailbox, 0xff, sizeof(mailbox));
+
+  bool found = intersect_list(grid->large, grid->num_large, mailbox, ray, intersect_primitives, data, hit, any_hit);
+  if (grid->num_items == 0 || (found && any_hit))
+    return found;
+
+  double origin[3] = {ray->origin.x, ray->origin.y, ray->origin.z};
+  double direction[3] = {ray->direction.x, ray->direction.y, ray->direction.z};
+  double t_enter = 0, t_leave = hit->t;
+
+  for (int a = 0; a < 3; a++)
+  {
+    double inv = 1.0 / direction[a];
+    double t0 = (axis_of(grid->bounds.min, a) - origin[a]) * inv;
+    double t1 = (axis_of(grid->bounds.max, a) - origin[a]) * inv;
+    if (t0 > t1)
+    {
+      double tmp = t0;
+      t0 = t1;
+      t1 = tmp;
+    }
+    /* NaN from 0 * inf leaves the interval untouched */
+    t_enter = t0 > t_enter ? t0 : t_enter;
+    t_leave = t1 < t_leave ? t1 : t_leave;
+  }
+
+  if (t_enter > t_leave)
+    return found;
+
+  int cell[3], step[3], end[3];
+  double t_next[3], t_delta[3];
+
+  for (int a = 0; a < 3; a++)
+  {
+    double min = axis_of(grid->bounds.min, a);
+    double size = axis_of(grid->cell_size, a);
+    double p = origin[a] + direction[a] * t_enter;
+
+    cell[a] = size > 0 ? (int)floor((p - min) / size) : 0;
+    cell[a] = MAX(0, MIN(grid->res[a] - 1, cell[a]));
+
+    if (direction[a] > 0)
+    {
+      step[a] = 1;
+      end[a] = grid->res[a];
+      t_next[a] = (min + (cell[a] + 1) * size - origin[a]) / direction[a];
+      t_delta[a] = size / direction[a];
+    }
+    else if (direction[a] < 0)
+    {
+      step[a] = -1;
+      end[a] = -1;
+      t_next[a] = (min + cell[a] * size - origin[a]) / direction[a];
+      t_delta[a] = -size / direction[a];
+    }
+    else
+    {
+      step[a] = 0;
+      end[a] = -1;
+      t_next[a] = DBL_MAX;
+      t_delta[a] = DBL_MAX;
+    }
+  }
+
+  for (;;)
+  {
+    size_t c = ((size_t)cell[2] * grid->res[1] + cell[1]) * grid->res[0] + cell[0];
+    uint begin = grid->cell_start[c];
+    if (intersect_list(&grid->items[begin], grid->cell_start[c + 1] - begin, mailbox, ray, intersect_primitives, data, hit, any_hit))
+    {
+      if (any_hit)
+        return true;
+      found = true;
+    }
+
+    int a = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+
+    /* anything hit before leaving this cell can not be beaten by later cells */
+    if (t_next[a] >= hit->t || t_next[a] > t_leave)
+      break;
+
+    cell[a] += step[a];
+    if (cell[a] == end[a])
+      break;
+    t_next[a] += t_delta[a];
+  }
+
+  return found;
+}
+
+/*==================[internal function definitions]=========================*/
+
+double axis_of(vec3 v, int axis)
+{
+  return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+void cell_range(const Grid *grid, AABB box, int lo[3], int hi[3])
+{
+  for (int a = 0; a < 3; a++)
+  {
+    double min = axis_of(grid->bounds.min, a);
+    double size = axis_of(grid->cell_size, a);
+    lo[a] = size > 0 ? (int)floor((axis_of(box.min, a) - min) / size) : 0;
+    hi[a] = size > 0 ? (int)floor((axis_of(box.max, a) - min) / size) : 0;
+    lo[a] = MAX(0, MIN(grid->res[a] - 1, lo[a]));
+    hi[a] = MAX(0, MIN(grid->res[a] - 1, hi[a]));
+  }
+}
+
+/*
+ * Primitives spanning several cells are skipped once they are in the
+ * mailbox, the rest is handed over in batches of GRID_BATCH_SIZE.
+ */
+bool intersect_list(const uint *items, uint count, uint *mailbox, const Ray *ray, IntersectPrimitives intersect_primitives, const void *data, Hit *hit, bool any_hit)
+{
+  uint batch[GRID_BATCH_SIZE];
+  uint n = 0;
+  bool found = false;
+
+  for (uint i = 0; i < count; i++)
+  {
+    uint primitive = items[i];
+    uint *slot = &mailbox[primitive & (GRID_MAILBOX_SIZE - 1)];
+    if (*slot == primitive)
+      continue;
+    *slot = primitive;
+
+    batch[n++] = primitive;
+    if (n == GRID_BATCH_SIZE)
+    {
+      if (intersect_primitives(ray, batch, n, data, hit))
+      {
+        if (any_hit)
+          return true;
+        found = true;
+      }
+      n = 0;
+    }
+  }
+
+  if (n > 0 && intersect_primitives(ray, batch, n, data, hit))
+    found = true;
+  return found;
+}
+
+/*==================[end of file]===========================================*/
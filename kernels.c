@@ -0,0 +1,91 @@
+/*==================[inclusions]============================================*/
+
+#include "raytracer.h"
+
+/*==================[macros]================================================*/
+/*==================[type definitions]======================================*/
+/*==================[external function declarations]========================*/
+/*==================[internal function declarations]========================*/
+/*==================[external constants]====================================*/
+/*==================[internal constants]====================================*/
+
+static const Kernels scalar_kernels = {
+  .isa = ISA_SCALAR,
+  .intersect_spheres = &intersect_spheres_scalar,
+  .intersect_triangles = &intersect_triangles_scalar,
+  .bvh8_intersect = &bvh8_intersect_scalar,
+};
+
+/*==================[external data]=========================================*/
+
+/* usable before init_kernels() runs, just never faster than scalar */
+Kernels kernels = {
+  .isa = ISA_SCALAR,
+  .intersect_spheres = &intersect_spheres_scalar,
+  .intersect_triangles = &intersect_triangles_scalar,
+  .bvh8_intersect = &bvh8_intersect_scalar,
+};
+
+/*==================[internal data]=========================================*/
+/*==================[external function definitions]=========================*/
+
+/* widest instruction set both the CPU and the OS (saved register state) support */
+Isa cpu_isa()
+{
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return ISA_AVX512;
+  if (__builtin_cpu_supports("avx2"))
+    return ISA_AVX2;
+#endif
+  return ISA_SCALAR;
+}
+
+/*
+ * Fills kernels with the widest variants up to max_isa this CPU runs.
+ * Call once before rendering starts, the table is read without locking.
+ * Single precision has no AVX-512 variants, a block of floats already
+ * fills an AVX2 register.
+ */
+void init_kernels(Isa max_isa)
+{
+  Isa isa = MIN(max_isa, cpu_isa());
+  kernels = scalar_kernels;
+
+#ifdef HAVE_X86_KERNELS
+  if (isa >= ISA_AVX2)
+  {
+    kernels.isa = ISA_AVX2;
+    kernels.intersect_spheres = &intersect_spheres_avx2;
+    kernels.intersect_triangles = &intersect_triangles_avx2;
+    kernels.bvh8_intersect = &bvh8_intersect_avx2;
+  }
+#ifndef SINGLE_PRECISION
+  if (isa >= ISA_AVX512)
+  {
+    /* the 8-wide node test is float, it stays on AVX2 */
+    kernels.isa = ISA_AVX512;
+    kernels.intersect_spheres = &intersect_spheres_avx512;
+    kernels.intersect_triangles = &intersect_triangles_avx512;
+  }
+#endif
+#endif
+}
+
+const char *isa_name(Isa isa)
+{
+  switch (isa)
+  {
+  case ISA_AVX512:
+    return "avx512";
+  case ISA_AVX2:
+    return "avx2";
+  case ISA_SCALAR:
+  default:
+    return "scalar";
+  }
+}
+
+/*==================[internal function definitions]=========================*/
+/*==================[end of file]===========================================*/
@@ -19,6 +19,17 @@
     .center = { (x), (y) + (r), (z) },\
     .radius = (r),\
 
+/* walls overlap by WALL_OVERLAP at the seams so no ray slips between them */
+#define WALL_OVERLAP (1.0)
+#define QUAD(x, y, z, ux, uy, uz, vx, vy, vz) \
+    .type = GEOMETRY_QUAD,\
+    .center = {\
+        (x) - ((ux) != 0) * WALL_OVERLAP - ((vx) != 0) * WALL_OVERLAP,\
+        (y) - ((uy) != 0) * WALL_OVERLAP - ((vy) != 0) * WALL_OVERLAP,\
+        (z) - ((uz) != 0) * WALL_OVERLAP - ((vz) != 0) * WALL_OVERLAP },\
+    .edge_u = { (ux) + ((ux) != 0) * 2 * WALL_OVERLAP, (uy) + ((uy) != 0) * 2 * WALL_OVERLAP, (uz) + ((uz) != 0) * 2 * WALL_OVERLAP },\
+    .edge_v = { (vx) + ((vx) != 0) * 2 * WALL_OVERLAP, (vy) + ((vy) != 0) * 2 * WALL_OVERLAP, (vz) + ((vz) != 0) * 2 * WALL_OVERLAP },\
+
 #define N_SPHERES (25)
 
 Options options = {
@@ -26,10 +37,14 @@ Options options = {
     .height = 180,
     .samples = 50,
     .result = "result.png",
-    .obj = "assets/cube.obj",
+    .obj = NULL,
+    .cache = NULL,
+    .instances = 1,
+    .isa = ISA_AVX512,
 };
 
 uint8_t *framebuffer = NULL;
+float *accumulation = NULL;
 
 extern long long ray_count;
 extern long long intersection_test_count;
@@ -38,12 +53,16 @@ void write_image(int signal)
 {
     if (framebuffer != NULL)
     {
+        /* also turns whatever is done into an image when interrupted */
+        resolve(framebuffer, accumulation, (size_t)options.width * options.height, options.samples);
+
         if (stbi_write_png(options.result, options.width, options.height, 3, framebuffer, options.width * 3) == 0)
             exit(EXIT_FAILURE);
         else
             printf("done.\n");
 
         free(framebuffer);
+        free(accumulation);
     }
 }
 
@@ -151,6 +170,9 @@ void parse_options(int argc, char **argv, Options *options)
     uint optind;
     for (optind = 1; optind < argc; optind++)
     {
+        if (argv[optind][0] != '-' || optind + 1 >= argc)
+            continue;
+
         switch (argv[optind][1])
         {
         case 'h':
@@ -165,6 +187,59 @@ void parse_options(int argc, char **argv, Options *options)
         case 'o':
             options->result = argv[optind + 1];
             break;
+        case 'm':
+            options->obj = argv[optind + 1];
+            break;
+        case 'i':
+            options->instances = MAX(1, atoi(argv[optind + 1]));
+            break;
+        case 'a':
+            if (strcmp(argv[optind + 1], "bvh8") == 0)
+                options->accel = ACCEL_BVH8;
+            else if (strcmp(argv[optind + 1], "grid") == 0)
+                options->accel = ACCEL_GRID;
+            else
+                options->accel = ACCEL_BVH;
+            break;
+        case 'c':
+            options->cache = argv[optind + 1];
+            break;
+        case 'b':
+            options->builder = strcmp(argv[optind + 1], "lbvh") == 0 ? BVH_LBVH : BVH_SAH;
+            break;
+        case 'p':
+            if (strcmp(argv[optind + 1], "wavefront") == 0)
+                options->integrator = INTEGRATOR_WAVEFRONT;
+            else
+                options->integrator = INTEGRATOR_RECURSIVE;
+            break;
+        case 'r':
+            options->sort_rays = strcmp(argv[optind + 1], "sort") == 0;
+            break;
+        case 'q':
+            if (strcmp(argv[optind + 1], "sobol") == 0)
+                options->sampler = SAMPLER_SOBOL;
+            else if (strcmp(argv[optind + 1], "bluenoise") == 0)
+                options->sampler = SAMPLER_BLUE_NOISE;
+            else
+                options->sampler = SAMPLER_RANDOM;
+            break;
+        case 'j':
+            if (strcmp(argv[optind + 1], "stratified") == 0)
+                options->pixel = PIXEL_STRATIFIED;
+            else if (strcmp(argv[optind + 1], "cmj") == 0)
+                options->pixel = PIXEL_CMJ;
+            else
+                options->pixel = PIXEL_JITTER;
+            break;
+        case 'x':
+            if (strcmp(argv[optind + 1], "scalar") == 0)
+                options->isa = ISA_SCALAR;
+            else if (strcmp(argv[optind + 1], "avx2") == 0)
+                options->isa = ISA_AVX2;
+            else
+                options->isa = ISA_AVX512;
+            break;
 
         default:
             break;
@@ -184,21 +259,25 @@ int main(int argc, char **argv)
 
     printf("seed = %d\n", seed);
     srand(seed);
+    options.seed = seed;
 
 
     if (argc <= 1)
     {
-        fprintf(stderr, "Usage: %s -w <width> -h <height> -s <samples per pixel> -o <filename>\n", argv[0]);
+        fprintf(stderr, "Usage: %s -w <width> -h <height> -s <samples per pixel> -o <filename> [-a bvh|bvh8|grid] [-b sah|lbvh] [-c <cache dir>] [-x scalar|avx2|avx512] [-p recursive|wavefront [-r sort|none]] [-q random|sobol|bluenoise] [-j jitter|stratified|cmj] [-m <model.obj> [-i <instances>]]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
     parse_options(argc, argv, &options);
 
+    init_kernels(options.isa);
+    printf("using %s kernels\n", isa_name(kernels.isa));
+
     vec3 pos = {0, 0, 0};
     vec3 size = {1, 1, 1.5};
 
-    const TriangleMesh cube = {
-        .num_triangles = 2,
+    TriangleMesh cube = {
+        .num_triangles = 12,
         .vertices = (Vertex[]){
             {{ -0.5f, +0.5f, -0.5f },{ 0.0f, 1.0f }},
             {{ +0.5f, +0.5f, -0.5f },{ 1.0f, 1.0f }},
@@ -245,7 +324,6 @@ int main(int argc, char **argv)
     const double room_depth = 30;
     const double room_height = 20;
     const double room_width = room_height * aspect_ratio;
-    const double radius = 10000;
     const  vec3 wall_color = VECTOR(0.75, 0.75, 0.75);
     const double light_radius = 15;
     const double y = -room_height;
@@ -253,59 +331,52 @@ int main(int argc, char **argv)
     uint lighting = M_DEFAULT;
 
 #if 1
-    Object scene[] = {
+    Object objects[] = {
 #if 1 /* walls */
         { // floor
             .color = wall_color, 
             .emission = BLACK,
             .flags = lighting,
-            .center =  {0, -radius - room_height, 0},
-            .radius = radius,
+            QUAD(-room_width, -room_height, -room_depth, 2 * room_width, 0, 0, 0, 0, 3 * room_depth)
         },
         { // back wall
             .color = wall_color, 
             .emission = BLACK,
             .flags = lighting,
-            .center = {0, 0, -radius - room_depth}, 
-            .radius = radius,
+            QUAD(-room_width, -room_height, -room_depth, 2 * room_width, 0, 0, 0, 2 * room_height, 0)
         },
         { // left wall
             .color = VECTOR(0.25, 0.75, 0.25), 
             .emission = BLACK,
             .flags = lighting,
-            .center =  {-radius - room_width, 0, 0}, 
-            .radius = radius,
+            QUAD(-room_width, -room_height, -room_depth, 0, 0, 3 * room_depth, 0, 2 * room_height, 0)
         },
         { // right wall
             .color = VECTOR(0.75, 0.25, 0.25), 
             .emission = BLACK,
             .flags = lighting,
-            .center =  {radius + room_width, 0, 0}, 
-            .radius = radius,
+            QUAD(room_width, -room_height, -room_depth, 0, 0, 3 * room_depth, 0, 2 * room_height, 0)
         },
         { // ceiling
             .color = wall_color, 
             .emission = BLACK,
             .flags = lighting,
-            .center = {0, radius + room_height, 0}, 
-            .radius = radius,
+            QUAD(-room_width, room_height, -room_depth, 2 * room_width, 0, 0, 0, 0, 3 * room_depth)
         },
         { // front wall
             .color = wall_color, 
             .emission = BLACK,
             .flags = lighting,
-            .center = {0, 0, radius + room_depth * 2}, 
-            .radius = radius,
+            QUAD(-room_width, -room_height, 2 * room_depth, 2 * room_width, 0, 0, 0, 2 * room_height, 0)
         },
 #endif
 #if 0 /* cube */
         {
             .type = GEOMETRY_MESH, 
-            .material = { 
-                .color = RGB(109,124,187), 
-                .flags = lighting | M_CHECKERED
-            }, 
-            .geometry.mesh = &cube
+            .color = RGB(109,124,187), 
+            .emission = BLACK,
+            .flags = lighting,
+            .mesh = &cube
         },
 #endif
 #if 0 /* objects */
@@ -396,14 +467,14 @@ int main(int argc, char **argv)
 #endif
 };
 #else
-    Object scene[N_SPHERES];
+    Object objects[N_SPHERES];
 #endif
 
 
 #if 0
     generate_random_spheres
     (
-        &scene[6], 
+        &objects[6], 
         N_SPHERES, 
         VECTOR(-room_width, -room_height, -room_depth), 
         VECTOR(room_width, room_height, room_depth)
@@ -412,7 +483,8 @@ int main(int argc, char **argv)
 
     size_t buff_len = sizeof(*framebuffer) * options.width * options.height * 3;
     framebuffer = malloc(buff_len);
-    if (framebuffer == NULL)
+    accumulation = calloc((size_t)options.width * options.height * 3, sizeof(*accumulation));
+    if (framebuffer == NULL || accumulation == NULL)
     {
         fprintf(stderr, "could not allocate framebuffer\n");
         exit(EXIT_FAILURE);
@@ -424,12 +496,70 @@ int main(int argc, char **argv)
     Camera camera;
     init_camera(&camera, VECTOR(0.0, 0, 50), VECTOR(0, 0, 0), &options);
 
+    size_t num_objects = sizeof(objects) / sizeof(objects[0]);
+    Object *scene_objects = objects;
+    TriangleMesh model = {0};
+    Transform *transforms = NULL;
+
+    if (options.obj != NULL)
+    {
+        if (!load_obj(options.obj, &model))
+        {
+            fprintf(stderr, "could not load '%s'\n", options.obj);
+            exit(EXIT_FAILURE);
+        }
+        printf("loaded %zu triangles from '%s'\n", model.num_triangles, options.obj);
+
+        scene_objects = malloc(sizeof(*scene_objects) * (num_objects + options.instances));
+        transforms = malloc(sizeof(*transforms) * options.instances);
+        memcpy(scene_objects, objects, sizeof(objects));
+
+        /* all instances share the triangles and the bottom level BVH of the model */
+        for (int i = 0; i < options.instances; i++)
+        {
+            double angle = 2 * PI * i / options.instances;
+            vec3 offset = options.instances > 1 ? VECTOR(10 * cos(angle), 0, 10 * sin(angle)) : VECTOR(0, 0, 0);
+            mat4 t, r, m;
+
+            translate(t, offset);
+            rotate(r, VECTOR(0, angle, 0));
+            mat4_mult(t, r, m);
+            init_transform(&transforms[i], m);
+
+            scene_objects[num_objects++] = (Object) {
+                .type = GEOMETRY_MESH,
+                .color = RGB(109, 124, 187),
+                .emission = BLACK,
+                .flags = lighting,
+                .mesh = &model,
+                .transform = &transforms[i]
+            };
+        }
+    }
+
+    Scene scene;
+    double build_start = omp_get_wtime();
+    init_scene(&scene, scene_objects, num_objects, &options);
+    if (options.accel == ACCEL_GRID)
+        printf("building grid took %f seconds\n", omp_get_wtime() - build_start);
+    else
+        printf("building %s BVH took %f seconds\n", options.builder == BVH_LBVH ? "LBVH" : "SAH", omp_get_wtime() - build_start);
+
     clock_t tic = clock();
 
-    render(framebuffer, scene, sizeof(scene) / sizeof(scene[0]), &camera, &options);
+    render(accumulation, &scene, &camera, &options);
 
     clock_t toc = clock();
 
+    free_scene(&scene);
+
+    if (options.obj != NULL)
+    {
+        free_mesh(&model);
+        free(scene_objects);
+        free(transforms);
+    }
+
     double time_taken = (double)((toc - tic) / CLOCKS_PER_SEC);
 
     printf("%d x %d (%d) pixels\n", options.width, options.height, options.width * options.height);
@@ -0,0 +1,490 @@
+/*==================[inclusions]============================================*/
+
+#include "raytracer.h"
+
+/*==================[macros]================================================*/
+
+#define PCG_MULTIPLIER  6364136223846793005ull
+#define PCG_INCREMENT   1442695040888963407ull
+#define GOLDEN_GAMMA    0x9e3779b97f4a7c15ull   /* splitmix64 stream step, spreads dimensions apart */
+
+#define BLUE_NOISE_SIZE   64    /* tile edge, a power of two */
+#define BLUE_NOISE_SIGMA  1.5   /* void and cluster filter width in pixels */
+
+/*==================[type definitions]======================================*/
+/*==================[external function declarations]========================*/
+/*==================[internal function declarations]========================*/
+
+static uint64_t mix64(uint64_t x);
+static uint32_t reverse_bits(uint32_t x);
+static uint32_t laine_karras_permutation(uint32_t x, uint32_t seed);
+static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed);
+static uint32_t pascal_transform(uint32_t index);
+static uint permute(uint i, uint l, uint32_t p);
+static uint blue_noise_rank(const Sampler *sampler, uint64_t hash);
+static void hilbert_cell(uint d, uint *x, uint *y);
+static void build_blue_noise(uint16_t *tile);
+static void toggle_point(float *energy, const float *kernel, uint p, float sign);
+static uint extreme_energy(const float *energy, const bool *on, bool want_on, bool largest);
+static void orthonormal_basis(vec3 n, vec3 *t, vec3 *b);
+
+/*==================[external constants]====================================*/
+/*==================[internal constants]====================================*/
+/*==================[external data]=========================================*/
+/*==================[internal data]=========================================*/
+
+/* ranks of a void and cluster pattern, see init_sampler() */
+static uint16_t blue_noise[BLUE_NOISE_SIZE * BLUE_NOISE_SIZE];
+static bool blue_noise_built;
+
+/*==================[external function definitions]=========================*/
+
+/*
+ * Scene setup only. rand() keeps one hidden state for the whole process,
+ * everything that runs per sample draws from an Rng instead.
+ */
+double random_double() { return (double)rand() / ((double)RAND_MAX + 1); }
+
+double random_range(double min, double max){ return random_double() * (max - min) + min; }
+
+/*
+ * Generator for one sample of one pixel. The state is a hash of the three
+ * indices, so a sample draws the same numbers whichever thread renders it
+ * and in whatever order, and no two threads ever share a state.
+ */
+Rng rng_seed(uint64_t seed, uint64_t pixel, uint64_t sample)
+{
+  return (Rng){mix64(mix64(mix64(seed) ^ pixel) ^ sample)};
+}
+
+/* PCG32, XSH RR output of a 64-bit LCG */
+uint32_t rng_next(Rng *rng)
+{
+  uint64_t old = rng->state;
+  rng->state = old * PCG_MULTIPLIER + PCG_INCREMENT;
+
+  uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+  uint32_t rot = (uint32_t)(old >> 59);
+  return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+/* uniform in [0, 1) */
+double rng_double(Rng *rng)
+{
+  return rng_next(rng) * 0x1p-32;
+}
+
+double rng_range(Rng *rng, double min, double max)
+{
+  return rng_double(rng) * (max - min) + min;
+}
+
+/* builds the tables type needs, call before rendering starts like init_kernels() */
+void init_sampler(SamplerType type)
+{
+  if (type == SAMPLER_BLUE_NOISE && !blue_noise_built)
+  {
+    build_blue_noise(blue_noise);
+    blue_noise_built = true;
+  }
+}
+
+/*
+ * Numbers for one sample of one pixel. The sampler hands out dimensions
+ * in the order they are asked for, the n-th draw of every sample of a
+ * pixel belongs to the same dimension. SAMPLER_RANDOM draws from the
+ * same Rng rng_seed() gives.
+ */
+Sampler sampler_seed(SamplerType type, uint64_t seed, uint x, uint y, uint sample)
+{
+  uint64_t pixel = (uint64_t)y << 32 | x;
+  return (Sampler){
+    .type = type,
+    .x = x,
+    .y = y,
+    .index = sample,
+    .seed = type == SAMPLER_BLUE_NOISE ? mix64(seed) : mix64(mix64(seed) ^ pixel),
+    .rng = rng_seed(seed, pixel, sample),
+  };
+}
+
+/*
+ * Padded Sobol after Burley, "Practical Hash-based Owen Scrambling"
+ * (JCGT 2020). Every draw of a sample gets its own point set from the
+ * first two Sobol dimensions: the sample index is shuffled and the
+ * coordinates are Owen scrambled with seeds hashed from the pixel and the
+ * dimension. The first 2^k samples of a pixel stay a (0,k,2)-net in every
+ * draw, while different draws and pixels are decorrelated.
+ *
+ * Shuffling the index keeps its low bits enumerating an aligned block of
+ * the sequence, which is a net as well. The first Sobol dimension is the
+ * bit reversal of the index, an Owen scramble works on the reversed bits,
+ * so the two reversals cancel.
+ */
+double sample_1d(Sampler *sampler)
+{
+  if (sampler->type == SAMPLER_RANDOM)
+    return rng_double(&sampler->rng);
+
+  uint64_t hash = mix64(sampler->seed + ++sampler->dimension * GOLDEN_GAMMA);
+  uint32_t index = nested_uniform_scramble(sampler->index, (uint32_t)hash);
+  double u = reverse_bits(laine_karras_permutation(index, (uint32_t)(hash >> 32))) * 0x1p-32;
+
+  if (sampler->type == SAMPLER_BLUE_NOISE)
+  {
+    u += (blue_noise_rank(sampler, ~hash) + 0.5) / (BLUE_NOISE_SIZE * BLUE_NOISE_SIZE);
+    u -= floor(u);
+  }
+  return u;
+}
+
+void sample_2d(Sampler *sampler, double *u, double *v)
+{
+  if (sampler->type == SAMPLER_RANDOM)
+  {
+    *u = rng_double(&sampler->rng);
+    *v = rng_double(&sampler->rng);
+    return;
+  }
+
+  uint64_t hash = mix64(sampler->seed + ++sampler->dimension * GOLDEN_GAMMA);
+  uint32_t index = nested_uniform_scramble(sampler->index, (uint32_t)hash);
+  *u = reverse_bits(laine_karras_permutation(index, (uint32_t)(hash >> 32))) * 0x1p-32;
+  *v = reverse_bits(laine_karras_permutation(pascal_transform(index), (uint32_t)mix64(hash))) * 0x1p-32;
+
+  if (sampler->type == SAMPLER_BLUE_NOISE)
+  {
+    uint x, y;
+    hilbert_cell(blue_noise_rank(sampler, ~hash), &x, &y);
+    *u += (x + 0.5) / BLUE_NOISE_SIZE;
+    *v += (y + 0.5) / BLUE_NOISE_SIZE;
+    *u -= floor(*u);
+    *v -= floor(*v);
+  }
+}
+
+/*
+ * Offset of one camera sample inside its pixel. The stratified and
+ * multi-jittered patterns (Kensler, "Correlated Multi-Jittered Sampling",
+ * Pixar 2013) lay an m x n grid with m * n >= samples over the pixel. In
+ * the CMJ pattern every sample also falls into its own one of the m * n
+ * columns and rows, the columns shuffled the same way in every row and the
+ * rows in every column. Sample indices are shuffled per pixel into the
+ * m * n cells, for counts that do not fill the grid the cells left over
+ * change from pixel to pixel instead of always being the last ones.
+ */
+void sample_pixel(Sampler *sampler, PixelPattern pattern, uint samples, double *du, double *dv)
+{
+  if (pattern == PIXEL_JITTER)
+  {
+    sample_2d(sampler, du, dv);
+    return;
+  }
+
+  uint m = MAX(1, (uint)sqrt(samples));
+  uint n = (samples + m - 1) / m;
+  uint32_t p = (uint32_t)mix64(sampler->seed ^ ((uint64_t)sampler->y << 32 | sampler->x));
+  uint s = permute(sampler->index, m * n, p * 0x51633e2du);
+  uint64_t jitter = mix64(((uint64_t)p << 32 | s) * GOLDEN_GAMMA);
+  double jx = (uint32_t)jitter * 0x1p-32, jy = (uint32_t)(jitter >> 32) * 0x1p-32;
+
+  if (pattern == PIXEL_STRATIFIED)
+  {
+    *du = (s % m + jx) / m;
+    *dv = (s / m + jy) / n;
+    return;
+  }
+
+  uint sx = permute(s % m, m, p * 0xa511e9b3u);
+  uint sy = permute(s / m, n, p * 0x63d83595u);
+  *du = (s % m + (sy + jx) / n) / m;
+  *dv = (s / m + (sx + jy) / m) / n;
+}
+
+/* uniform over the sphere, z and the angle around it are both uniform */
+vec3 random_on_unit_sphere(Sampler *sampler)
+{
+  double u, v;
+  sample_2d(sampler, &u, &v);
+
+  double z = 1 - 2 * u;
+  double r = sqrt(MAX(0.0, 1 - z * z));
+  double phi = 2 * PI * v;
+  return VECTOR(r * cos(phi), r * sin(phi), z);
+}
+
+/*
+ * Hemisphere around normal, which has to be unit length, with density
+ * cos / PI. Uniform points on the disk lifted up to the hemisphere (Malley),
+ * the cosine of the surface cancels against the density.
+ */
+vec3 random_cosine_direction(vec3 normal, Sampler *sampler)
+{
+  double u, v;
+  sample_2d(sampler, &u, &v);
+
+  double r = sqrt(u);
+  double z = sqrt(1 - u);
+  double phi = 2 * PI * v;
+
+  vec3 t, b;
+  orthonormal_basis(normal, &t, &b);
+  return vec3_add(vec3_add(vec3_scalar_mult(t, r * cos(phi)), vec3_scalar_mult(b, r * sin(phi))), vec3_scalar_mult(normal, z));
+}
+
+/*==================[internal function definitions]=========================*/
+
+/* splitmix64 finalizer, every input bit affects every output bit */
+uint64_t mix64(uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  x ^= x >> 31;
+  return x;
+}
+
+uint32_t reverse_bits(uint32_t x)
+{
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+/* every bit only flips depending on the bits below it, in reversed order an Owen scramble */
+uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+{
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return x;
+}
+
+uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+{
+  return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+}
+
+/*
+ * Second Sobol dimension, reversed. Its generator matrix is Pascal's
+ * triangle mod 2, by Lucas' theorem bit j of the result is the parity of
+ * the index bits whose positions contain all bits of j.
+ */
+uint32_t pascal_transform(uint32_t index)
+{
+  index ^= (index >> 1) & 0x55555555u;
+  index ^= (index >> 2) & 0x33333333u;
+  index ^= (index >> 4) & 0x0f0f0f0fu;
+  index ^= (index >> 8) & 0x00ff00ffu;
+  index ^= (index >> 16) & 0x0000ffffu;
+  return index;
+}
+
+/*
+ * SAMPLER_BLUE_NOISE scrambles the Sobol points the same way for every
+ * pixel and shifts them per pixel by a value from a blue noise tile
+ * (Cranley-Patterson rotation). Every draw reads the tile at its own
+ * offset, the same for all pixels, so neighbouring pixels get values far
+ * apart and the error of a few samples per pixel is high frequency grain
+ * the eye averages out, instead of blotches. 2D draws walk the rank along
+ * a Hilbert curve, nearby ranks stay nearby in the square, so the pixels
+ * that land in any small region are a blue noise subset as well.
+ */
+uint blue_noise_rank(const Sampler *sampler, uint64_t hash)
+{
+  const uint mask = BLUE_NOISE_SIZE - 1;
+  uint x = (sampler->x + (uint)hash) & mask;
+  uint y = (sampler->y + (uint)(hash >> 32)) & mask;
+  assert(blue_noise_built);
+  return blue_noise[y * BLUE_NOISE_SIZE + x];
+}
+
+/* cell d of the Hilbert curve through a BLUE_NOISE_SIZE square */
+void hilbert_cell(uint d, uint *x, uint *y)
+{
+  *x = *y = 0;
+  for (uint s = 1; s < BLUE_NOISE_SIZE; s *= 2, d /= 4)
+  {
+    uint rx = 1 & (d / 2), ry = 1 & (d ^ rx);
+    if (ry == 0)
+    {
+      if (rx == 1)
+      {
+        *x = s - 1 - *x;
+        *y = s - 1 - *y;
+      }
+      uint t = *x;
+      *x = *y;
+      *y = t;
+    }
+    *x += s * rx;
+    *y += s * ry;
+  }
+}
+
+/*
+ * Void and cluster (Ulichney 1993) on a torus. A sparse random pattern is
+ * relaxed by moving its tightest cluster into its largest void until that
+ * changes nothing. Ranks then count down while removing the tightest
+ * clusters of the relaxed pattern and up while filling its largest voids.
+ * Filling the largest void of the points is filling the tightest cluster
+ * of the gaps, the Gaussian weights over the whole torus sum to a constant.
+ */
+void build_blue_noise(uint16_t *tile)
+{
+  const uint n = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+  float *kernel = malloc(sizeof(*kernel) * n);
+  float *energy = calloc(n, sizeof(*energy));
+  float *relaxed_energy = malloc(sizeof(*relaxed_energy) * n);
+  bool *on = calloc(n, sizeof(*on));
+  bool *relaxed = malloc(sizeof(*relaxed) * n);
+  uint *rank = malloc(sizeof(*rank) * n);
+  assert(kernel != NULL && energy != NULL && relaxed_energy != NULL && on != NULL && relaxed != NULL && rank != NULL);
+
+  /* kernel[dy * size + dx] weighs a point dx, dy away, the short way around */
+  for (uint dy = 0; dy < BLUE_NOISE_SIZE; dy++)
+    for (uint dx = 0; dx < BLUE_NOISE_SIZE; dx++)
+    {
+      double x = MIN(dx, BLUE_NOISE_SIZE - dx), y = MIN(dy, BLUE_NOISE_SIZE - dy);
+      kernel[dy * BLUE_NOISE_SIZE + dx] = exp(-(x * x + y * y) / (2 * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+    }
+
+  Rng rng = rng_seed(0, 0, 0);
+  uint ones = 0;
+  while (ones < n / 10)
+  {
+    uint p = rng_next(&rng) % n;
+    if (!on[p])
+    {
+      on[p] = true;
+      toggle_point(energy, kernel, p, 1);
+      ones++;
+    }
+  }
+
+  for (uint moves = 0; moves < n; moves++)
+  {
+    uint cluster = extreme_energy(energy, on, true, true);
+    on[cluster] = false;
+    toggle_point(energy, kernel, cluster, -1);
+
+    uint void_ = extreme_energy(energy, on, false, false);
+    on[void_] = true;
+    toggle_point(energy, kernel, void_, 1);
+    if (void_ == cluster)
+      break;
+  }
+  memcpy(relaxed, on, sizeof(*on) * n);
+  memcpy(relaxed_energy, energy, sizeof(*energy) * n);
+
+  for (uint r = ones; r-- > 0;)
+  {
+    uint cluster = extreme_energy(energy, on, true, true);
+    on[cluster] = false;
+    toggle_point(energy, kernel, cluster, -1);
+    rank[cluster] = r;
+  }
+
+  memcpy(on, relaxed, sizeof(*on) * n);
+  memcpy(energy, relaxed_energy, sizeof(*energy) * n);
+  for (uint r = ones; r < n; r++)
+  {
+    uint void_ = extreme_energy(energy, on, false, false);
+    on[void_] = true;
+    toggle_point(energy, kernel, void_, 1);
+    rank[void_] = r;
+  }
+
+  for (uint p = 0; p < n; p++)
+    tile[p] = rank[p];
+
+  free(rank);
+  free(relaxed);
+  free(on);
+  free(relaxed_energy);
+  free(energy);
+  free(kernel);
+}
+
+/* adds (sign 1) or removes (sign -1) the Gaussian of point p to the energy of every pixel */
+void toggle_point(float *energy, const float *kernel, uint p, float sign)
+{
+  const uint mask = BLUE_NOISE_SIZE - 1;
+  uint px = p % BLUE_NOISE_SIZE, py = p / BLUE_NOISE_SIZE;
+
+  for (uint y = 0; y < BLUE_NOISE_SIZE; y++)
+  {
+    const float *row = &kernel[((y - py) & mask) * BLUE_NOISE_SIZE];
+    for (uint x = 0; x < BLUE_NOISE_SIZE; x++)
+      energy[y * BLUE_NOISE_SIZE + x] += sign * row[(x - px) & mask];
+  }
+}
+
+/* first pixel with the largest or smallest energy among those that are on or off */
+uint extreme_energy(const float *energy, const bool *on, bool want_on, bool largest)
+{
+  const uint n = BLUE_NOISE_SIZE * BLUE_NOISE_SIZE;
+  uint best = n;
+  for (uint p = 0; p < n; p++)
+  {
+    if (on[p] != want_on)
+      continue;
+    if (best == n || (largest ? energy[p] > energy[best] : energy[p] < energy[best]))
+      best = p;
+  }
+  return best;
+}
+
+/* Duff et al., "Building an Orthonormal Basis, Revisited" (JCGT 2017) */
+void orthonormal_basis(vec3 n, vec3 *t, vec3 *b)
+{
+  REAL sign = copysign((REAL)1, n.z);
+  REAL a = -1 / (sign + n.z);
+  REAL c = n.x * n.y * a;
+  *t = VECTOR(1 + sign * n.x * n.x * a, sign * c, -sign * n.x);
+  *b = VECTOR(c, sign + n.y * n.y * a, -n.y);
+}
+
+/*
+ * i-th element of a random permutation of [0, l) picked by p, after
+ * Kensler. The hash is a bijection on the next power of two, cycle
+ * walking skips the values past l.
+ */
+uint permute(uint i, uint l, uint32_t p)
+{
+  uint32_t w = l - 1;
+  w |= w >> 1;
+  w |= w >> 2;
+  w |= w >> 4;
+  w |= w >> 8;
+  w |= w >> 16;
+  do
+  {
+    i ^= p;
+    i *= 0xe170893du;
+    i ^= p >> 16;
+    i ^= (i & w) >> 4;
+    i ^= p >> 8;
+    i *= 0x0929eb3fu;
+    i ^= p >> 23;
+    i ^= (i & w) >> 1;
+    i *= 1 | p >> 27;
+    i *= 0x6935fa69u;
+    i ^= (i & w) >> 11;
+    i *= 0x74dcb303u;
+    i ^= (i & w) >> 2;
+    i *= 0x9e501cc3u;
+    i ^= (i & w) >> 2;
+    i *= 0xc860a3dfu;
+    i &= w;
+    i ^= i >> 5;
+  } while (i >= l);
+  return (i + p) % l;
+}
+
+/*==================[end of file]===========================================*/
@@ -8,26 +8,39 @@
 
 /*==================[macros]================================================*/
 /*==================[type definitions]======================================*/
+
+typedef struct
+{
+  char *data[4];
+  int count;
+} FileBuffers;
 /*==================[external function declarations]========================*/
 /*==================[internal function declarations]========================*/
 
-static double mix(double a, double b, double mix);
-
-static vec3 random_on_unit_sphere();
-static vec3 random_on_hemisphere(vec3);
-
 static vec3 phong(vec3 color, vec3 light_dir, vec3 normal, vec3 camera_origin, vec3 position, bool in_shadow, double ka, double ks, double kd, double alpha);
-static Ray get_camera_ray(const Camera *camera, double u, double v);
-
-static vec3 cast_ray(Ray *ray, Object *scene, size_t nobj, int depth);
-static vec3 trace_path(Ray *ray, Object *scene, size_t nobj, int depth);
 
-static vec3 reflect(const vec3 In, const vec3 N);
-static vec3 refract(const vec3 In, const vec3 N, double iot);
-
-static vec3 checkered_texture(vec3 color, double u, double v, double M);
-
-static bool intersect(const Ray *ray, Object *objects, size_t n, Hit *hit);
+static vec3 cast_ray(Ray *ray, const Scene *scene, int depth);
+static MULTIVERSION vec3 shade_whitted(Ray *ray, Hit hit, const Scene *scene, int depth);
+static vec3 trace_path(Ray *ray, const Scene *scene, int depth, Sampler *sampler);
+static MULTIVERSION vec3 shade_path(Ray *ray, Hit hit, const Scene *scene, int depth, Sampler *sampler);
+
+static REAL offset_ulps(REAL x, REAL normal);
+
+static void split_objects(Scene *scene);
+static AABB object_bounds(const Geometry *geometry);
+static void build_hierarchy(Scene *scene, AccelType accel, BVHBuilder builder);
+static void remap_indices(uint *indices, size_t n, const uint *ids);
+static bool test_object(const Ray *ray, uint primitive, const Geometry *geometry, Hit *hit, bool any_hit);
+static bool test_objects(const Ray *ray, const uint *primitives, uint count, const Scene *scene, Hit *hit, bool any_hit);
+static bool intersect_objects(const Ray *ray, const uint *primitives, uint count, const void *data, Hit *hit);
+static bool occlude_objects(const Ray *ray, const uint *primitives, uint count, const void *data, Hit *hit);
+static bool query_scene(const Ray *ray, const Scene *scene, Hit *hit, bool any_hit);
+static void surface_attributes(const Ray *ray, const Scene *scene, Hit *hit);
+static bool intersect_mesh_triangles(const Ray *ray, const uint *primitives, uint count, const void *data, Hit *hit);
+
+static void build_mesh_bvh(TriangleMesh *mesh, Options *options);
+static bool traverse(const BVH *bvh, const BVH8 *wide, const Ray *ray, IntersectPrimitives intersect_primitives, const void *data, Hit *hit, bool any_hit);
+static void read_file(void *ctx, const char *filename, int is_mtl, const char *obj_filename, char **buf, size_t *len);
 
 /*==================[external constants]====================================*/
 /*==================[internal constants]====================================*/
@@ -41,7 +54,7 @@ long long intersection_test_count = 0;
 
 vec3 calculate_surface_normal(vec3 v0, vec3 v1, vec3 v2)
 { 
-  return vec3_normalize(vec3_cross(vec3_sub(v2, v0), vec3_sub(v1, v0))); 
+  return vec3_normalize(vec3_cross(vec3_sub(v1, v0), vec3_sub(v2, v0))); 
 }
 
 void init_camera(Camera *camera, vec3 position, vec3 target, Options *options)
@@ -74,27 +87,27 @@ void init_camera(Camera *camera, vec3 position, vec3 target, Options *options)
   camera->lower_left_corner = llc_new;
 }
 
-bool intersect_sphere(const Ray *ray, vec3 center, double radius, Hit *hit)
+bool intersect_sphere(const Ray *ray, vec3 center, REAL radius, Hit *hit)
 {
   intersection_test_count++;
 
-  double t0, t1; // solutions for t if the ray intersects
+  REAL t0, t1; // solutions for t if the ray intersects
   vec3 L = vec3_sub(center, ray->origin);
-  double tca = vec3_dot(L, ray->direction);
+  REAL tca = vec3_dot(L, ray->direction);
   if (tca < 0)
     return false;
-  double d2 = vec3_dot(L, L) - tca * tca;
-  double radius2 = radius * radius;
+  REAL d2 = vec3_dot(L, L) - tca * tca;
+  REAL radius2 = radius * radius;
   if (d2 > radius2)
     return false;
 
-  double thc = sqrt(radius2 - d2);
+  REAL thc = sqrt(radius2 - d2);
   t0 = tca - thc;
   t1 = tca + thc;
 
   if (t0 > t1)
   {
-    double tmp = t0;
+    REAL tmp = t0;
     t0 = t1;
     t1 = tmp;
   }
@@ -106,7 +119,7 @@ bool intersect_sphere(const Ray *ray, vec3 center, double radius, Hit *hit)
       return false; // both t0 and t1 are negative
   }
 
-  if (t0 > EPSILON)
+  if (t0 > 0)
   {
     hit->t = t0;
     return true;
@@ -117,6 +130,87 @@ bool intersect_sphere(const Ray *ray, vec3 center, double radius, Hit *hit)
   }
 }
 
+bool intersect_plane(const Ray *ray, vec3 point, vec3 normal, Hit *hit)
+{
+  intersection_test_count++;
+
+  REAL denom = vec3_dot(normal, ray->direction);
+  if (fabs(denom) < EPSILON)
+    return false; // parallel to the plane
+
+  REAL t = vec3_dot(vec3_sub(point, ray->origin), normal) / denom;
+  if (t > 0)
+  {
+    hit->t = t;
+    return true;
+  }
+  return false;
+}
+
+bool intersect_quad(const Ray *ray, vec3 corner, vec3 edge_u, vec3 edge_v, Hit *hit)
+{
+  intersection_test_count++;
+
+  vec3 n = vec3_cross(edge_u, edge_v);
+  REAL denom = vec3_dot(n, ray->direction);
+  if (fabs(denom) < EPSILON)
+    return false;
+
+  REAL t = vec3_dot(vec3_sub(corner, ray->origin), n) / denom;
+  if (t <= 0)
+    return false;
+
+  // coordinates of the hit point along both edges
+  vec3 w = vec3_sub(point_at(ray, t), corner);
+  REAL nn = vec3_dot(n, n);
+  REAL u = vec3_dot(n, vec3_cross(w, edge_v)) / nn;
+  REAL v = vec3_dot(n, vec3_cross(edge_u, w)) / nn;
+  if (u < 0.0 || u > 1.0 || v < 0.0 || v > 1.0)
+    return false;
+
+  hit->t = t;
+  hit->u = u;
+  hit->v = v;
+  return true;
+}
+
+bool intersect_box(const Ray *ray, vec3 center, vec3 extent, Hit *hit)
+{
+  intersection_test_count++;
+
+  vec3 lo = vec3_sub(vec3_sub(center, extent), ray->origin);
+  vec3 hi = vec3_sub(vec3_add(center, extent), ray->origin);
+  REAL o[3] = {lo.x, lo.y, lo.z}, h[3] = {hi.x, hi.y, hi.z};
+  REAL d[3] = {ray->direction.x, ray->direction.y, ray->direction.z};
+  REAL t_near = -REAL_MAX, t_far = REAL_MAX;
+
+  for (int a = 0; a < 3; a++)
+  {
+    if (d[a] == 0)
+    {
+      if (o[a] > 0 || h[a] < 0)
+        return false;
+      continue;
+    }
+
+    REAL t0 = o[a] / d[a], t1 = h[a] / d[a];
+    t_near = MAX(t_near, MIN(t0, t1));
+    t_far = MIN(t_far, MAX(t0, t1));
+  }
+
+  if (t_near > t_far)
+    return false;
+
+  // leaving the box when the ray starts inside
+  REAL t = t_near > 0 ? t_near : t_far;
+  if (t > 0)
+  {
+    hit->t = t;
+    return true;
+  }
+  return false;
+}
+
 bool intersect_triangle(const Ray *ray, Vertex vertex0, Vertex vertex1, Vertex vertex2, Hit *hit)
 {
   intersection_test_count++;
@@ -128,14 +222,14 @@ bool intersect_triangle(const Ray *ray, Vertex vertex0, Vertex vertex1, Vertex v
   v2 = vertex2.pos;
 
   vec3 edge1, edge2, h, s, q;
-  double a, f, u, v, t;
+  REAL a, f, u, v, t;
   edge1 = vec3_sub(v1, v0);
   edge2 = vec3_sub(v2, v0);
   h = vec3_cross(ray->direction, edge2);
   a = vec3_dot(edge1, h);
   if (a > -EPSILON && a < EPSILON)
     return false; // This ray is parallel to this triangle.
-  f = 1.0 / a;
+  f = 1 / a;
   s = vec3_sub(ray->origin, v0);
   u = f * vec3_dot(s, h);
   if (u < 0.0 || u > 1.0)
@@ -147,7 +241,7 @@ bool intersect_triangle(const Ray *ray, Vertex vertex0, Vertex vertex1, Vertex v
   // At this stage we can compute t to find out where the intersection point is on the line.
   t = f * vec3_dot(edge2, q);
 
-  if (t > EPSILON)
+  if (t > 0)
   {
     hit->t = t;
 
@@ -173,161 +267,400 @@ bool intersect_triangle(const Ray *ray, Vertex vertex0, Vertex vertex1, Vertex v
   }
 }
 
-void render(uint8_t *framebuffer, Object *objects, size_t n_objects, Camera *camera, Options *options)
+void init_scene(Scene *scene, Object *objects, size_t num_objects, Options *options)
+{
+  scene->objects = objects;
+  scene->num_objects = num_objects;
+  scene->geometry = malloc(sizeof(*scene->geometry) * MAX(num_objects, 1));
+  scene->materials = malloc(sizeof(*scene->materials) * MAX(num_objects, 1));
+  assert(scene->geometry != NULL && scene->materials != NULL);
+  split_objects(scene);
+
+  for (uint i = 0; i < num_objects; i++)
+  {
+    if (objects[i].type == GEOMETRY_MESH && objects[i].mesh->bvh.nodes == NULL)
+      build_mesh_bvh(objects[i].mesh, options);
+  }
+
+  scene->bvh = (BVH){0};
+  scene->wide = (BVH8){0};
+  scene->grid = (Grid){0};
+
+  sphere_buffer_build(&scene->spheres, objects, num_objects);
+
+  scene->num_unbounded = 0;
+  scene->unbounded = malloc(sizeof(*scene->unbounded) * MAX(num_objects, 1));
+  assert(scene->unbounded != NULL);
+  for (uint i = 0; i < num_objects; i++)
+  {
+    if (objects[i].type == GEOMETRY_PLANE)
+      scene->unbounded[scene->num_unbounded++] = i;
+  }
+
+  build_hierarchy(scene, options->accel, options->builder);
+}
+
+/*
+ * Call after moving or resizing objects between frames. Refits the object
+ * hierarchy in place and falls back to a full rebuild once the SAH cost grew
+ * past BVH_REBUILD_RATIO. Meshes are assumed rigid. Returns true on rebuild.
+ * Grids are always rebuilt, binning is about as cheap as a refit.
+ */
+bool update_scene(Scene *scene, Options *options)
+{
+  split_objects(scene);
+
+  AABB *bounds = malloc(sizeof(*bounds) * scene->num_objects);
+  assert(scene->num_objects == 0 || bounds != NULL);
+
+  for (uint i = 0; i < scene->num_objects; i++)
+    bounds[i] = object_bounds(&scene->geometry[i]);
+
+  sphere_buffer_free(&scene->spheres);
+  sphere_buffer_build(&scene->spheres, scene->objects, scene->num_objects);
+
+  if (scene->grid.num_cells > 0)
+  {
+    grid_free(&scene->grid);
+    build_hierarchy(scene, ACCEL_GRID, options->builder);
+    free(bounds);
+    return true;
+  }
+
+  /* leaves hold object ids, so the refit reads the boxes by id */
+  bvh_refit(&scene->bvh, bounds);
+
+  bool rebuild = bvh_cost(&scene->bvh) > BVH_REBUILD_RATIO * scene->bvh.build_cost;
+  if (rebuild)
+  {
+    bvh_free(&scene->bvh);
+    build_hierarchy(scene, ACCEL_BVH, options->builder);
+  }
+
+  /* the wide layout is cheap to collapse again from the binary tree */
+  if (scene->wide.num_nodes > 0)
+  {
+    bvh8_free(&scene->wide);
+    bvh8_build(&scene->wide, &scene->bvh);
+  }
+
+  free(bounds);
+  return rebuild;
+}
+
+void free_scene(Scene *scene)
+{
+  for (uint i = 0; i < scene->num_objects; i++)
+  {
+    if (scene->objects[i].type == GEOMETRY_MESH)
+    {
+      bvh_free(&scene->objects[i].mesh->bvh);
+      bvh8_free(&scene->objects[i].mesh->wide);
+      triangle_buffer_free(&scene->objects[i].mesh->triangles);
+    }
+  }
+
+  bvh_free(&scene->bvh);
+  bvh8_free(&scene->wide);
+  grid_free(&scene->grid);
+  sphere_buffer_free(&scene->spheres);
+  free(scene->geometry);
+  free(scene->materials);
+  scene->geometry = NULL;
+  scene->materials = NULL;
+  free(scene->unbounded);
+  scene->unbounded = NULL;
+  scene->num_unbounded = 0;
+}
+
+bool load_obj(const char *filename, TriangleMesh *mesh)
+{
+  tinyobj_attrib_t attrib;
+  tinyobj_shape_t *shapes = NULL;
+  tinyobj_material_t *materials = NULL;
+  size_t num_shapes = 0, num_materials = 0;
+  FileBuffers buffers = {.count = 0};
+
+  tinyobj_attrib_init(&attrib);
+
+  int result = tinyobj_parse_obj(&attrib, &shapes, &num_shapes, &materials, &num_materials, filename, read_file, &buffers, TINYOBJ_FLAG_TRIANGULATE);
+
+  for (int i = 0; i < buffers.count; i++)
+    free(buffers.data[i]);
+
+  /* the parser may have allocated some of these before it failed */
+  if (result != TINYOBJ_SUCCESS)
+  {
+    tinyobj_attrib_free(&attrib);
+    tinyobj_shapes_free(shapes, num_shapes);
+    tinyobj_materials_free(materials, num_materials);
+    return false;
+  }
+
+  /* count triangles, faces with more than three vertices are fanned out */
+  size_t num_triangles = 0;
+  for (uint f = 0; f < attrib.num_face_num_verts; f++)
+    num_triangles += MAX(attrib.face_num_verts[f] - 2, 0);
+
+  mesh->num_triangles = num_triangles;
+  mesh->vertices = malloc(sizeof(*mesh->vertices) * num_triangles * 3);
+  mesh->bvh = (BVH){0};
+  mesh->wide = (BVH8){0};
+  mesh->triangles = (TriangleBuffer){0};
+  assert(num_triangles == 0 || mesh->vertices != NULL);
+
+  size_t face_offset = 0, v = 0;
+  for (uint f = 0; f < attrib.num_face_num_verts; f++)
+  {
+    int n = attrib.face_num_verts[f];
+    for (int k = 1; k + 1 < n; k++)
+    {
+      int corners[3] = {0, k, k + 1};
+      for (int c = 0; c < 3; c++)
+      {
+        tinyobj_vertex_index_t idx = attrib.faces[face_offset + corners[c]];
+        Vertex *vertex = &mesh->vertices[v++];
+
+        vertex->pos = (vec3){attrib.vertices[3 * idx.v_idx + 0], attrib.vertices[3 * idx.v_idx + 1], attrib.vertices[3 * idx.v_idx + 2]};
+        if (idx.vt_idx >= 0 && idx.vt_idx != (int)TINYOBJ_INVALID_INDEX)
+          vertex->tex = (vec2){attrib.texcoords[2 * idx.vt_idx + 0], attrib.texcoords[2 * idx.vt_idx + 1]};
+        else
+          vertex->tex = (vec2){0, 0};
+      }
+    }
+    face_offset += n;
+  }
+
+  tinyobj_attrib_free(&attrib);
+  tinyobj_shapes_free(shapes, num_shapes);
+  tinyobj_materials_free(materials, num_materials);
+  return true;
+}
+
+void free_mesh(TriangleMesh *mesh)
 {
-  const double gamma = 5.0;
+  bvh_free(&mesh->bvh);
+  bvh8_free(&mesh->wide);
+  triangle_buffer_free(&mesh->triangles);
+  free(mesh->vertices);
+  mesh->vertices = NULL;
+  mesh->num_triangles = 0;
+}
 
+/* leaves the sum of all samples per pixel in accumulation, RGB floats in scanline order, see resolve() */
+void render(float *accumulation, const Scene *scene, Camera *camera, Options *options)
+{
   const int str_len = 40;
   const char* done = "========================================";
   const char* todo = "----------------------------------------";
 
+  init_sampler(options->sampler);
+
+  if (options->integrator == INTEGRATOR_WAVEFRONT)
+  {
+    render_wavefront(accumulation, scene, camera, options);
+    return;
+  }
+
+  /* each sample of a PACKET_WIDTH x PACKET_HEIGHT tile finds its primary hits as one packet */
   #pragma omp parallel for
-  for (uint y = 0; y < options->height; y++)
+  for (uint y0 = 0; y0 < options->height; y0 += PACKET_HEIGHT)
   {
     if (0 == omp_get_thread_num())
     {
-      if (y % 10 == 0)
+      if (y0 % 10 == 0)
       {
-        double percentage = ((double)y * omp_get_num_threads() / (double)options->height) * 100.0;
+        double percentage = ((double)y0 * omp_get_num_threads() / (double)options->height) * 100.0;
         int p = str_len - (percentage / 100.0) * str_len;
         printf("[%s%s] %0.02f %%\n", done + (p), todo + (str_len - p), percentage);
       }
     }
 
-    for (uint x = 0; x < options->width; x++)
+    for (uint x0 = 0; x0 < options->width; x0 += PACKET_WIDTH)
     {
-      Ray ray;
-      vec3 pixel = {0, 0, 0};
+      Ray rays[PACKET_SIZE];
+      Hit hits[PACKET_SIZE];
+      vec3 pixels[PACKET_SIZE];
+      Sampler samplers[PACKET_SIZE];
+      uint active = 0;
+
+      for (uint i = 0; i < PACKET_SIZE; i++)
+      {
+        uint x = x0 + i % PACKET_WIDTH, y = y0 + i / PACKET_WIDTH;
+        if (x < options->width && y < options->height)
+          active |= 1u << i;
+        pixels[i] = ZERO_VECTOR;
+      }
+
       for (uint s = 0; s < options->samples; s++)
       {
-        double u = (double)(x + random_double()) / ((double)options->width - 1.0);
-        double v = (double)(y + random_double()) / ((double)options->height - 1.0);
+        for (uint lanes = active; lanes != 0; lanes &= lanes - 1)
+        {
+          uint i = __builtin_ctz(lanes);
+          uint x = x0 + i % PACKET_WIDTH, y = y0 + i / PACKET_WIDTH;
+          double du, dv;
+          samplers[i] = sampler_seed(options->sampler, options->seed, x, y, s);
+          sample_pixel(&samplers[i], options->pixel, options->samples, &du, &dv);
+          double u = (double)(x + du) / ((double)options->width - 1.0);
+          double v = (double)(y + dv) / ((double)options->height - 1.0);
+          rays[i] = get_camera_ray(camera, u, v);
+        }
 
-        ray = get_camera_ray(camera, u, v);
+        uint found = intersect_packet(rays, active, scene, hits);
+
+        for (uint lanes = active; lanes != 0; lanes &= lanes - 1)
+        {
+          uint i = __builtin_ctz(lanes);
+          ray_count++;
 #if 1
-        vec3 sample = trace_path(&ray, objects, n_objects, 0);
+          vec3 sample = (found >> i) & 1 ? shade_path(&rays[i], hits[i], scene, 0, &samplers[i]) : BACKGROUND;
 #else
-        vec3 sample = cast_ray(&ray, objects, n_objects, 0);
+          vec3 sample = (found >> i) & 1 ? shade_whitted(&rays[i], hits[i], scene, 0) : BACKGROUND;
 #endif
-        pixel = vec3_add(pixel, sample);
+          pixels[i] = vec3_add(pixels[i], sample);
+        }
       }
 
-      pixel = vec3_scalar_mult(pixel, 1.0 / (double)options->samples);
-
-      uint i = (y * options->width + x) * 3;
-      framebuffer[i + 0] = (uint8_t)(255.0 * CLAMP(pow(pixel.x, 1 / gamma)));
-      framebuffer[i + 1] = (uint8_t)(255.0 * CLAMP(pow(pixel.y, 1 / gamma)));
-      framebuffer[i + 2] = (uint8_t)(255.0 * CLAMP(pow(pixel.z, 1 / gamma)));
+      for (uint lanes = active; lanes != 0; lanes &= lanes - 1)
+      {
+        uint i = __builtin_ctz(lanes);
+        size_t p = ((size_t)(y0 + i / PACKET_WIDTH) * options->width + x0 + i % PACKET_WIDTH) * 3;
+        accumulation[p + 0] = pixels[i].x;
+        accumulation[p + 1] = pixels[i].y;
+        accumulation[p + 2] = pixels[i].z;
+      }
     }
   }
 }
 
 /*==================[internal function definitions]=========================*/
 
-double random_double() { return (double)rand() / ((double)RAND_MAX + 1); }
-
-double random_range(double min, double max){ return random_double() * (max - min) + min; }
-
-vec3 random_on_unit_sphere()
+void read_file(void *ctx, const char *filename, int is_mtl, const char *obj_filename, char **buf, size_t *len)
 {
-  vec3 p;
-  double d = 100000;
-  int loop_counter = 0;
+  FileBuffers *buffers = ctx;
 
-  do {
-    assert(++loop_counter < 100);
-    p = VECTOR(random_range(-1, 1), random_range(-1, 1), random_range(-1, 1));
-  } while(vec3_length(p) > 1);
+  *buf = NULL;
+  *len = 0;
 
-  return vec3_normalize(p);
-}
+  /* tinyobj already resolves material libraries relative to the .obj */
+  FILE *file = fopen(filename, "rb");
+  if (file == NULL || buffers->count == sizeof(buffers->data) / sizeof(buffers->data[0]))
+  {
+    if (file != NULL)
+      fclose(file);
+    return;
+  }
 
-vec3 random_on_hemisphere(vec3 normal)
-{
-  vec3 d = random_on_unit_sphere();
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
 
-  if (vec3_dot(d, normal) < 0)
-    return vec3_scalar_mult(d, -1);
+  /* tinyobj does not take ownership, load_obj() frees the buffers */
+  *buf = malloc(size + 1);
+  if (*buf != NULL && fread(*buf, 1, size, file) == (size_t)size)
+  {
+    (*buf)[size] = '\0';
+    *len = size;
+    buffers->data[buffers->count++] = *buf;
+  }
   else
-    return d;
+  {
+    free(*buf);
+    *buf = NULL;
+  }
+  fclose(file);
 }
 
 double mix(double a, double b, double mix) { return b * mix + a * (1 - mix); } 
 
 vec3 point_at(const Ray *ray, double t) { return vec3_add(ray->origin, vec3_scalar_mult(ray->direction, t)); }
 
+/*
+ * Pushes a surface point along normal by a few ulps of its coordinates, so
+ * rays leaving from it can not hit the same surface again regardless of
+ * precision and scene scale. Waechter and Binder, "A Fast and Robust Method
+ * for Avoiding Self-Intersection", Ray Tracing Gems, 2019.
+ */
+vec3 offset_ray_origin(vec3 point, vec3 normal)
+{
+  return (vec3){
+    offset_ulps(point.x, normal.x),
+    offset_ulps(point.y, normal.y),
+    offset_ulps(point.z, normal.z),
+  };
+}
+
+REAL offset_ulps(REAL x, REAL normal)
+{
+  if (fabs(x) < OFFSET_ORIGIN)
+    return x + OFFSET_FLOAT_SCALE * normal;
+
+#ifdef SINGLE_PRECISION
+  int32_t bits, ulps = (int32_t)(OFFSET_INT_SCALE * normal);
+#else
+  int64_t bits, ulps = (int64_t)(OFFSET_INT_SCALE * normal);
+#endif
+  memcpy(&bits, &x, sizeof(x));
+  bits += x < 0 ? -ulps : ulps;
+  memcpy(&x, &bits, sizeof(x));
+  return x;
+}
+
+/* starts on the side of the surface the direction points to */
+Ray spawn_ray(const Hit *hit, vec3 direction)
+{
+  vec3 normal = vec3_dot(direction, hit->normal) < 0 ? vec3_scalar_mult(hit->normal, -1) : hit->normal;
+  return (Ray){offset_ray_origin(hit->point, normal), direction};
+}
+
 vec3 clamp(const vec3 v) { return (vec3){CLAMP(v.x), CLAMP(v.y), CLAMP(v.z)}; }
 
-#if 0
-mat4 translate(vec3 v, mat4* m)
-{
-  mat4 m = {1, 0, 0, v.x,
-             0, 1, 0, v.y,
-             0, 0, 1, v.z,
-             0, 0, 0, 1};
-  return m;
-}
-
-mat4 rotate(vec3 v)
-{
-  mat4 rotate_x = {{1, 0, 0, 0,
-                    0, cos(v.x), -sin(v.x), 0,
-                    0, sin(v.x), cos(v.x), 0,
-                    0, 0, 0, 1}};
-
-  mat4 rotate_y = {{
-      cos(v.y),
-      0,
-      sin(v.y),
-      0,
-      0,
-      1,
-      0,
-      0,
-      -sin(v.y),
-      0,
-      cos(v.y),
-      0,
-      0,
-      0,
-      0,
-      1,
-  }};
-
-  mat4 rotate_z = {{
-      cos(v.z),
-      -sin(v.z),
-      0,
-      0,
-      sin(v.z),
-      cos(v.z),
-      0,
-      0,
-      0,
-      0,
-      1,
-      0,
-      0,
-      0,
-      0,
-      1,
-  }};
-
-  return rotate_y;
-}
-
-mat4 scale(const vec3 v)
-{
-  mat4 sm = {{
-    v.x, 0, 0,0,
-    0, v.y, 0,0,
-    0, 0, v.z,0,
-    0,0,0,1
-  }};
-
-  return sm;
+void translate(mat4 m, vec3 v)
+{
+  mat4 t = {1, 0, 0, v.x,
+            0, 1, 0, v.y,
+            0, 0, 1, v.z,
+            0, 0, 0, 1};
+  memcpy(m, t, sizeof(mat4));
+}
+
+/* euler angles in radians, applied in x, y, z order */
+void rotate(mat4 m, vec3 v)
+{
+  mat4 rotate_x = {1, 0, 0, 0,
+                   0, cos(v.x), -sin(v.x), 0,
+                   0, sin(v.x), cos(v.x), 0,
+                   0, 0, 0, 1};
+
+  mat4 rotate_y = {cos(v.y), 0, sin(v.y), 0,
+                   0, 1, 0, 0,
+                   -sin(v.y), 0, cos(v.y), 0,
+                   0, 0, 0, 1};
+
+  mat4 rotate_z = {cos(v.z), -sin(v.z), 0, 0,
+                   sin(v.z), cos(v.z), 0, 0,
+                   0, 0, 1, 0,
+                   0, 0, 0, 1};
+
+  mat4 yx;
+  mat4_mult(rotate_y, rotate_x, yx);
+  mat4_mult(rotate_z, yx, m);
+}
+
+void scale(mat4 m, vec3 v)
+{
+  mat4 s = {v.x, 0, 0, 0,
+            0, v.y, 0, 0,
+            0, 0, v.z, 0,
+            0, 0, 0, 1};
+  memcpy(m, s, sizeof(mat4));
+}
+
+bool init_transform(Transform *transform, mat4 object_to_world)
+{
+  memcpy(transform->object_to_world, object_to_world, sizeof(mat4));
+  return mat4_inverse(transform->object_to_world, transform->world_to_object);
 }
-#endif
 
 void print_v(const char *msg, const vec3 v)
 {
@@ -390,77 +723,435 @@ vec3 checkered_texture(vec3 color, double u, double v, double M)
   return vec3_scalar_mult(color, c);
 }
 
-bool intersect(const Ray *ray, Object *objects, size_t n, Hit *hit)
+/* copies the traversal fields of every object into the geometry table and the rest into the materials */
+void split_objects(Scene *scene)
 {
-  // ray_count++;
-  double old_t = hit != NULL ? hit->t : DBL_MAX;
-  double min_t = old_t;
+  for (uint i = 0; i < scene->num_objects; i++)
+  {
+    const Object *object = &scene->objects[i];
+    Geometry *geometry = &scene->geometry[i];
 
-  Hit local = {.t = DBL_MAX};
+    geometry->type = object->type;
+    geometry->center = object->center;
+    switch (object->type)
+    {
+    case GEOMETRY_MESH:
+      geometry->shape.instance.mesh = object->mesh;
+      geometry->shape.instance.transform = object->transform;
+      break;
+    case GEOMETRY_PLANE:
+      geometry->shape.normal = object->normal;
+      break;
+    case GEOMETRY_QUAD:
+      geometry->shape.edge[0] = object->edge_u;
+      geometry->shape.edge[1] = object->edge_v;
+      break;
+    case GEOMETRY_BOX:
+      geometry->shape.extent = object->extent;
+      break;
+    case GEOMETRY_SPHERE:
+    default:
+      geometry->shape.radius = object->radius;
+      break;
+    }
 
-  for (uint i = 0; i < n; i++)
+    scene->materials[i] = (Material){.flags = object->flags, .color = object->color, .emission = object->emission};
+  }
+}
+
+AABB object_bounds(const Geometry *geometry)
+{
+  switch (geometry->type)
   {
-    Object *object = &objects[i];
-    if (intersect_sphere(ray, objects[i].center, objects[i].radius, &local) && local.t < min_t)
+  case GEOMETRY_MESH:
+  {
+    const TriangleMesh *mesh = geometry->shape.instance.mesh;
+    const Transform *transform = geometry->shape.instance.transform;
+    if (mesh->bvh.num_nodes == 0)
+      return aabb_empty();
+
+    AABB local = mesh->bvh.nodes[0].bounds;
+    if (transform == NULL)
+      return local;
+
+    /* bound the transformed corners of the object space box */
+    AABB world = aabb_empty();
+    for (int i = 0; i < 8; i++)
     {
-      min_t = local.t;
-      local.object_id = i;
-      local.point = point_at(ray, local.t);
-      local.normal = vec3_normalize(vec3_sub(local.point, objects[i].center));
-      local.u = atan2(local.normal.x, local.normal.z) / (2 * PI) + 0.5;
-      local.v = local.normal.y * 0.5 + 0.5;
+      vec3 corner = {
+        (i & 1) ? local.max.x : local.min.x,
+        (i & 2) ? local.max.y : local.min.y,
+        (i & 4) ? local.max.z : local.min.z,
+      };
+      corner = mat4_vector_mult((REAL *)transform->object_to_world, corner);
+      world = (AABB){vec3_min(world.min, corner), vec3_max(world.max, corner)};
     }
- 
-    /*
-    switch (objects[i].type)
-    {
-    case GEOMETRY_MESH:
-    {
-      TriangleMesh *mesh = objects[i].geometry.mesh;
-      for (uint ti = 0; ti < mesh->num_triangles; ti++)
-      {
-        Vertex v0 = mesh->vertices[(ti * 3) + 0];
-        Vertex v1 = mesh->vertices[(ti * 3) + 1];
-        Vertex v2 = mesh->vertices[(ti * 3) + 2];
+    return world;
+  }
+  case GEOMETRY_PLANE:
+    return aabb_empty(); /* unbounded, kept out of the hierarchy */
+  case GEOMETRY_QUAD:
+  {
+    const vec3 *edge = geometry->shape.edge;
+    vec3 far = vec3_add(geometry->center, vec3_add(edge[0], edge[1]));
+    AABB box = {vec3_min(geometry->center, far), vec3_max(geometry->center, far)};
+    vec3 corner_u = vec3_add(geometry->center, edge[0]);
+    vec3 corner_v = vec3_add(geometry->center, edge[1]);
+    box.min = vec3_min(box.min, vec3_min(corner_u, corner_v));
+    box.max = vec3_max(box.max, vec3_max(corner_u, corner_v));
+    return box;
+  }
+  case GEOMETRY_BOX:
+    return (AABB){vec3_sub(geometry->center, geometry->shape.extent), vec3_add(geometry->center, geometry->shape.extent)};
+  case GEOMETRY_SPHERE:
+  default:
+  {
+    REAL radius = geometry->shape.radius;
+    vec3 r = {radius, radius, radius};
+    return (AABB){vec3_sub(geometry->center, r), vec3_add(geometry->center, r)};
+  }
+  }
+}
 
-        if (intersect_triangle(ray, v0, v1, v2, &local) && local.t < min_t)
-        {
-          min_t = local.t;
-          local.object_id = i;
-          local.point = point_at(ray, local.t);
-          local.normal = calculate_surface_normal(v0.pos, v1.pos, v2.pos);
-        }
-      }
-      break;
-    }
-    case GEOMETRY_SPHERE:
+/*
+ * Builds the grid or the BVH over the objects that have a bounding box.
+ * Planes are tested through scene->unbounded and empty meshes can not be
+ * hit, so neither is handed to the builders. The builders number the
+ * primitives by their position in the compacted list, the leaves are
+ * mapped back to object ids afterwards.
+ */
+void build_hierarchy(Scene *scene, AccelType accel, BVHBuilder builder)
+{
+  AABB *bounds = malloc(sizeof(*bounds) * MAX(scene->num_objects, 1));
+  uint *ids = malloc(sizeof(*ids) * MAX(scene->num_objects, 1));
+  assert(bounds != NULL && ids != NULL);
+
+  size_t n = 0;
+  for (uint i = 0; i < scene->num_objects; i++)
+  {
+    AABB box = object_bounds(&scene->geometry[i]);
+    if (box.min.x > box.max.x)
+      continue;
+    bounds[n] = box;
+    ids[n++] = i;
+  }
+
+  if (accel == ACCEL_GRID)
+  {
+    grid_build(&scene->grid, bounds, n);
+    remap_indices(scene->grid.items, scene->grid.num_items, ids);
+    remap_indices(scene->grid.large, scene->grid.num_large, ids);
+  }
+  else
+  {
+    bvh_build(&scene->bvh, bounds, n, builder);
+    remap_indices(scene->bvh.indices, scene->bvh.num_indices, ids);
+    if (accel == ACCEL_BVH8)
+      bvh8_build(&scene->wide, &scene->bvh);
+  }
+
+  free(bounds);
+  free(ids);
+}
+
+void remap_indices(uint *indices, size_t n, const uint *ids)
+{
+  for (size_t i = 0; i < n; i++)
+    indices[i] = ids[indices[i]];
+}
+
+void build_mesh_bvh(TriangleMesh *mesh, Options *options)
+{
+  AABB *bounds = malloc(sizeof(*bounds) * mesh->num_triangles);
+  assert(mesh->num_triangles == 0 || bounds != NULL);
+
+  for (uint i = 0; i < mesh->num_triangles; i++)
+  {
+    const Vertex *v = &mesh->vertices[i * 3];
+    bounds[i] = (AABB){
+      vec3_min(v[0].pos, vec3_min(v[1].pos, v[2].pos)),
+      vec3_max(v[0].pos, vec3_max(v[1].pos, v[2].pos)),
+    };
+  }
+
+  char path[4096];
+  uint64_t key = 0;
+  bool cached = false;
+
+  if (options->cache != NULL)
+  {
+    key = bvh_cache_key(bounds, mesh->num_triangles, options->builder);
+    snprintf(path, sizeof(path), "%s/%016llx.bvh", options->cache, (unsigned long long)key);
+    cached = bvh_cache_load(&mesh->bvh, path, key);
+  }
+
+  if (!cached)
+  {
+    bvh_build(&mesh->bvh, bounds, mesh->num_triangles, options->builder);
+    if (options->cache != NULL && mesh->num_triangles > 0 && !bvh_cache_save(&mesh->bvh, path, key))
+      fprintf(stderr, "could not write BVH cache %s\n", path);
+  }
+  free(bounds);
+
+  triangle_buffer_build(&mesh->triangles, mesh->vertices, &mesh->bvh);
+
+  mesh->wide = (BVH8){0};
+  if (options->accel == ACCEL_BVH8)
+    bvh8_build(&mesh->wide, &mesh->bvh);
+}
+
+/* prefers the wide layout when it was built */
+bool traverse(const BVH *bvh, const BVH8 *wide, const Ray *ray, IntersectPrimitives intersect_primitives, const void *data, Hit *hit, bool any_hit)
+{
+  if (wide->num_nodes > 0)
+    return bvh8_intersect(wide, ray, intersect_primitives, data, hit, any_hit);
+  else
+    return bvh_intersect(bvh, ray, intersect_primitives, data, hit, any_hit);
+}
+
+/* fills in point, normal and texture coordinates once the closest hit is known */
+void surface_attributes(const Ray *ray, const Scene *scene, Hit *hit)
+{
+  const Geometry *geometry = &scene->geometry[hit->object_id];
+  hit->point = point_at(ray, hit->t);
+
+  switch (geometry->type)
+  {
+  case GEOMETRY_MESH:
+  {
+    const Transform *transform = geometry->shape.instance.transform;
+    const Vertex *v = &geometry->shape.instance.mesh->vertices[hit->primitive_id * 3];
+    hit->normal = calculate_surface_normal(v[0].pos, v[1].pos, v[2].pos);
+
+    /* the kernel leaves barycentric coordinates behind */
+    double b1 = hit->u, b2 = hit->v;
+    vec2 tex = vec2_add(vec2_add(vec2_scalar_mult(v[0].tex, 1 - b1 - b2), vec2_scalar_mult(v[1].tex, b1)), vec2_scalar_mult(v[2].tex, b2));
+    hit->u = tex.x;
+    hit->v = tex.y;
+
+    if (transform != NULL)
     {
-      if (intersect_sphere(ray, objects[i].geometry.sphere, &local) && local.t < min_t)
-      {
-        min_t = local.t;
-        local.object_id = i;
-        local.point = point_at(ray, local.t);
-        local.normal = normalize(sub(local.point, objects[i].geometry.sphere->center));
-        local.u = atan2(local.normal.x, local.normal.z) / (2 * PI) + 0.5;
-        local.v = local.normal.y * 0.5 + 0.5;
-      }
-      break;
+      REAL *world_to_object = (REAL *)transform->world_to_object;
+      hit->normal = vec3_normalize(mat4_transpose_direction_mult(world_to_object, hit->normal));
     }
-    default:
+    break;
+  }
+  case GEOMETRY_PLANE:
+  case GEOMETRY_QUAD:
+  {
+    /* two sided, the normal faces the incoming ray */
+    vec3 n = geometry->type == GEOMETRY_PLANE ? geometry->shape.normal : vec3_cross(geometry->shape.edge[0], geometry->shape.edge[1]);
+    hit->normal = vec3_normalize(vec3_dot(n, ray->direction) > 0 ? vec3_scalar_mult(n, -1) : n);
+    break;
+  }
+  case GEOMETRY_BOX:
+  {
+    /* the face whose slab the point is closest to leaving */
+    vec3 p = vec3_sub(hit->point, geometry->center);
+    vec3 e = geometry->shape.extent;
+    double q[3] = {fabs(p.x / e.x), fabs(p.y / e.y), fabs(p.z / e.z)};
+    int axis = q[0] > q[1] ? (q[0] > q[2] ? 0 : 2) : (q[1] > q[2] ? 1 : 2);
+    hit->normal = axis == 0 ? VECTOR(p.x > 0 ? 1 : -1, 0, 0)
+                : axis == 1 ? VECTOR(0, p.y > 0 ? 1 : -1, 0)
+                            : VECTOR(0, 0, p.z > 0 ? 1 : -1);
+    break;
+  }
+  case GEOMETRY_SPHERE:
+  default:
+  {
+    hit->normal = vec3_normalize(vec3_sub(hit->point, geometry->center));
+    hit->u = atan2(hit->normal.x, hit->normal.z) / (2 * PI) + 0.5;
+    hit->v = hit->normal.y * 0.5 + 0.5;
+    break;
+  }
+  }
+}
+
+/* runs the scene level structure, hit->t bounds the search */
+bool query_scene(const Ray *ray, const Scene *scene, Hit *hit, bool any_hit)
+{
+  IntersectPrimitives test = any_hit ? &occlude_objects : &intersect_objects;
+
+  /* planes are in neither the grid nor the BVH */
+  bool found = test(ray, scene->unbounded, scene->num_unbounded, scene, hit);
+  if (found && any_hit)
+    return true;
+
+  if (scene->grid.num_cells > 0)
+    return grid_intersect(&scene->grid, ray, test, scene, hit, any_hit) || found;
+
+  return traverse(&scene->bvh, &scene->wide, ray, test, scene, hit, any_hit) || found;
+}
+
+/* leaves reference consecutive slots of the mesh triangle buffer */
+bool intersect_mesh_triangles(const Ray *ray, const uint *primitives, uint count, const void *data, Hit *hit)
+{
+  assert(primitives[count - 1] == primitives[0] + count - 1);
+  return intersect_triangles(&((const TriangleMesh *)data)->triangles, ray, primitives[0], count, hit);
+}
+
+bool intersect_objects(const Ray *ray, const uint *primitives, uint count, const void *data, Hit *hit)
+{
+  return test_objects(ray, primitives, count, data, hit, false);
+}
+
+/* shadow rays only need to know whether anything is hit before hit->t */
+bool occlude_objects(const Ray *ray, const uint *primitives, uint count, const void *data, Hit *hit)
+{
+  return test_objects(ray, primitives, count, data, hit, true);
+}
+
+/* spheres go through the packed kernel in one batch, everything else one at a time */
+bool test_objects(const Ray *ray, const uint *primitives, uint count, const Scene *scene, Hit *hit, bool any_hit)
+{
+  bool found = intersect_spheres(&scene->spheres, ray, primitives, count, hit);
+  if (found && any_hit)
+    return true;
+
+  for (uint i = 0; i < count; i++)
+  {
+    if (scene->spheres.radius2[primitives[i]] >= 0)
+      continue;
+
+    if (test_object(ray, primitives[i], scene->geometry, hit, any_hit))
     {
-      puts("unknown geometry");
-      exit(EXIT_FAILURE);
+      if (any_hit)
+        return true;
+      found = true;
     }
+  }
+  return found;
+}
+
+bool test_object(const Ray *ray, uint primitive, const Geometry *geometry, Hit *hit, bool any_hit)
+{
+  const Geometry *object = &geometry[primitive];
+  Hit local = {.t = hit->t};
+
+  switch (object->type)
+  {
+  case GEOMETRY_MESH:
+  {
+    const TriangleMesh *mesh = object->shape.instance.mesh;
+    const Transform *transform = object->shape.instance.transform;
+    Ray object_ray = *ray;
+
+    /* direction stays unnormalized so t is the same in both spaces */
+    if (transform != NULL)
+    {
+      REAL *world_to_object = (REAL *)transform->world_to_object;
+      object_ray.origin = mat4_vector_mult(world_to_object, ray->origin);
+      object_ray.direction = mat4_direction_mult(world_to_object, ray->direction);
     }
-    */
+
+    if (!traverse(&mesh->bvh, &mesh->wide, &object_ray, &intersect_mesh_triangles, mesh, &local, any_hit))
+      return false;
+    break;
+  }
+  case GEOMETRY_SPHERE: /* normally handled by intersect_spheres() */
+  {
+    if (!intersect_sphere(ray, object->center, object->shape.radius, &local) || local.t >= hit->t)
+      return false;
+    break;
+  }
+  case GEOMETRY_PLANE:
+  {
+    if (!intersect_plane(ray, object->center, object->shape.normal, &local) || local.t >= hit->t)
+      return false;
+    break;
   }
+  case GEOMETRY_QUAD:
+  {
+    if (!intersect_quad(ray, object->center, object->shape.edge[0], object->shape.edge[1], &local) || local.t >= hit->t)
+      return false;
+    break;
+  }
+  case GEOMETRY_BOX:
+  {
+    if (!intersect_box(ray, object->center, object->shape.extent, &local) || local.t >= hit->t)
+      return false;
+    break;
+  }
+  default:
+  {
+    puts("unknown geometry");
+    exit(EXIT_FAILURE);
+  }
+  }
+
+  local.object_id = primitive;
+  *hit = local;
+  return true;
+}
+
+bool intersect(const Ray *ray, const Scene *scene, Hit *hit)
+{
+  // ray_count++;
+  Hit local = {.t = hit != NULL ? hit->t : REAL_MAX};
+
+  if (!query_scene(ray, scene, &local, false))
+    return false;
 
   if (hit != NULL)
   {
+    /* surface attributes are only needed for the closest hit */
+    surface_attributes(ray, scene, &local);
     memcpy(hit, &local, sizeof(*hit));
   }
 
-  return min_t < old_t;
+  return true;
+}
+
+/*
+ * Closest hits for a packet of up to PACKET_SIZE rays, lanes not set in
+ * active are left alone. The packet only shares traversal of the binary
+ * object BVH, other structures fall back to one ray at a time. Returns
+ * the mask of lanes that hit something.
+ */
+uint intersect_packet(const Ray *rays, uint active, const Scene *scene, Hit *hits)
+{
+  uint found = 0;
+
+  for (uint lanes = active; lanes != 0; lanes &= lanes - 1)
+    hits[__builtin_ctz(lanes)].t = REAL_MAX;
+
+  if (scene->grid.num_cells > 0 || scene->wide.num_nodes > 0)
+  {
+    for (uint lanes = active; lanes != 0; lanes &= lanes - 1)
+    {
+      int i = __builtin_ctz(lanes);
+      if (intersect(&rays[i], scene, &hits[i]))
+        found |= 1u << i;
+    }
+    return found;
+  }
+
+  for (uint lanes = active; lanes != 0; lanes &= lanes - 1)
+  {
+    int i = __builtin_ctz(lanes);
+    if (intersect_objects(&rays[i], scene->unbounded, scene->num_unbounded, scene, &hits[i]))
+      found |= 1u << i;
+  }
+
+  found |= bvh_intersect_packet(&scene->bvh, rays, active, &intersect_objects, scene, hits);
+
+  for (uint lanes = found; lanes != 0; lanes &= lanes - 1)
+  {
+    int i = __builtin_ctz(lanes);
+    surface_attributes(&rays[i], scene, &hits[i]);
+  }
+  return found;
+}
+
+/*
+ * Any-hit visibility test for shadow rays. Only blockers closer than
+ * max_distance count and traversal stops at the first one found, no
+ * surface attributes are computed.
+ */
+bool occluded(const Ray *ray, const Scene *scene, REAL max_distance)
+{
+  Hit local = {.t = max_distance};
+  return query_scene(ray, scene, &local, true);
 }
 
 vec3 phong(vec3 color, vec3 light_dir, vec3 normal, vec3 camera_origin, vec3 position, bool in_shadow, double ka, double ks, double kd, double alpha)
@@ -479,29 +1170,36 @@ vec3 phong(vec3 color, vec3 light_dir, vec3 normal, vec3 camera_origin, vec3 pos
   return in_shadow ? ZERO_VECTOR : clamp(vec3_add(vec3_add(ambient, diffuse), specular));
 }
 
-vec3 trace_path(Ray *ray, Object *objects, size_t nobj, int depth)
+vec3 trace_path(Ray *ray, const Scene *scene, int depth, Sampler *sampler)
 {
   ray_count++;
-  Hit hit = { .t = DBL_MAX };
+  Hit hit = { .t = REAL_MAX };
 
-  if (depth > MAX_DEPTH || !intersect(ray, objects, nobj, &hit))
+  if (depth > MAX_DEPTH || !intersect(ray, scene, &hit))
   {
     return BACKGROUND;
   }
 
+  return shade_path(ray, hit, scene, depth, sampler);
+}
+
+/* continues a path from a known hit, render() gets primary hits from packets */
+MULTIVERSION vec3 shade_path(Ray *ray, Hit hit, const Scene *scene, int depth, Sampler *sampler)
+{
   vec3 radiance;
-  vec3 albedo       = objects[hit.object_id].color;
-  vec3 emission     = objects[hit.object_id].emission;
+  const Material *material = &scene->materials[hit.object_id];
+  vec3 albedo       = material->color;
+  vec3 emission     = material->emission;
 
   /* russian roulette */
   double prob = MAX(albedo.x, MAX(albedo.y, albedo.z));
 
-  if (random_double() < prob)
+  if (sample_1d(sampler) < prob)
     albedo = vec3_scalar_mult(albedo, 1 / prob);
   else
     return emission;
 
-  uint flags = objects[hit.object_id].flags;
+  uint flags = material->flags;
 
   if (flags & M_CHECKERED)
   {
@@ -509,7 +1207,6 @@ vec3 trace_path(Ray *ray, Object *objects, size_t nobj, int depth)
   }
 
   Ray R;
-  R.origin = hit.point;
 
   if (flags & M_REFRACTION)
   {
@@ -520,59 +1217,64 @@ vec3 trace_path(Ray *ray, Object *objects, size_t nobj, int depth)
     double kt           = (1 - fresnel) * transparency;
 
 #if 1
-    R.direction = vec3_normalize(refract(vec3_scalar_mult(ray->direction, -1), hit.normal, 1.0));
-    vec3 refraction = trace_path(&R, objects, nobj, depth + 1);
+    R = spawn_ray(&hit, vec3_normalize(refract(vec3_scalar_mult(ray->direction, -1), hit.normal, 1.0)));
+    vec3 refraction = trace_path(&R, scene, depth + 1, sampler);
 
-    R.direction = vec3_normalize(reflect(vec3_scalar_mult(ray->direction, 1), hit.normal));
-    vec3 reflection = trace_path(&R, objects, nobj, depth + 1);
+    R = spawn_ray(&hit, vec3_normalize(reflect(vec3_scalar_mult(ray->direction, 1), hit.normal)));
+    vec3 reflection = trace_path(&R, scene, depth + 1, sampler);
 
     radiance = vec3_add(vec3_scalar_mult(refraction, kt), vec3_scalar_mult(reflection, kr));
 #else
-    double p = random_double();
+    double p = sample_1d(sampler);
     if ((p * transparency) < fresnel)
-      R.direction = normalize(refract(ray->direction, hit.normal, 1.0));
+      R = spawn_ray(&hit, normalize(refract(ray->direction, hit.normal, 1.0)));
     else
-      R.direction = normalize(reflect(ray->direction, hit.normal));
+      R = spawn_ray(&hit, normalize(reflect(ray->direction, hit.normal)));
     
-    radiance = trace_path(&R, objects, nobj, depth + 1);
+    radiance = trace_path(&R, scene, depth + 1, sampler);
 #endif
   }
   else if(flags & M_REFLECTION)
   {
-    R.direction = reflect(ray->direction, hit.normal);
-    radiance =  trace_path(&R, objects, nobj, depth + 1);
+    R = spawn_ray(&hit, reflect(ray->direction, hit.normal));
+    radiance =  trace_path(&R, scene, depth + 1, sampler);
   }
   else 
   {
-    R.direction = random_on_hemisphere(hit.normal);
-    //double cos_theta = -dot(ray->direction, hit.normal);
-    double cos_theta = vec3_dot(R.direction, hit.normal);
-    radiance =  vec3_scalar_mult(trace_path(&R, objects, nobj, depth + 1), cos_theta);
+    R = spawn_ray(&hit, random_cosine_direction(hit.normal, sampler));
+    radiance =  vec3_scalar_mult(trace_path(&R, scene, depth + 1, sampler), DIFFUSE_WEIGHT);
   }
     
   return vec3_add(emission, vec3_mult(albedo, radiance));
 }
 
-vec3 cast_ray(Ray *ray, Object *objects, size_t nobj, int depth)
+vec3 cast_ray(Ray *ray, const Scene *scene, int depth)
 {
   ray_count++;
-  Hit hit = {.t = DBL_MAX };
+  Hit hit = {.t = REAL_MAX };
 
-  if (depth > MAX_DEPTH || !intersect(ray, objects, nobj, &hit))
+  if (depth > MAX_DEPTH || !intersect(ray, scene, &hit))
   {
     return BACKGROUND;
   }
 
+  return shade_whitted(ray, hit, scene, depth);
+}
+
+MULTIVERSION vec3 shade_whitted(Ray *ray, Hit hit, const Scene *scene, int depth)
+{
   vec3 out_color = ZERO_VECTOR;
   vec3 light_pos = {2, 7, 2};
   vec3 light_color = {1, 1, 1};
 
-  Ray light_ray = {hit.point, vec3_normalize(vec3_sub(light_pos, hit.point))};
+  vec3 to_light = vec3_sub(light_pos, hit.point);
+  Ray light_ray = spawn_ray(&hit, vec3_normalize(to_light));
 
-  bool in_shadow = intersect(&light_ray, objects, nobj, NULL);
+  bool in_shadow = occluded(&light_ray, scene, vec3_length(to_light));
   
-  vec3 object_color = objects[hit.object_id].color;
-  uint flags = objects[hit.object_id].flags;
+  const Material *material = &scene->materials[hit.object_id];
+  vec3 object_color = material->color;
+  uint flags = material->flags;
 
   double ka = 0.25;
   double kd = 0.5;
@@ -610,8 +1312,8 @@ vec3 cast_ray(Ray *ray, Object *objects, size_t nobj, int depth)
   if (flags & M_REFLECTION)
   {
     kr = 1.0;
-    Ray r = { hit.point, vec3_normalize(reflect(ray->direction, hit.normal)) };
-    reflection = cast_ray(&r, objects, nobj, depth + 1);
+    Ray r = spawn_ray(&hit, vec3_normalize(reflect(ray->direction, hit.normal)));
+    reflection = cast_ray(&r, scene, depth + 1);
   }
   
   if (flags & M_REFRACTION)
@@ -623,8 +1325,8 @@ vec3 cast_ray(Ray *ray, Object *objects, size_t nobj, int depth)
     kr = fresnel;
     kt = (1 - fresnel) * transparency;
 
-    Ray r = { hit.point, vec3_normalize(refract(ray->direction, hit.normal, 1.0))};
-    refraction = cast_ray(&r, objects, nobj, depth + 1);
+    Ray r = spawn_ray(&hit, vec3_normalize(refract(ray->direction, hit.normal, 1.0)));
+    refraction = cast_ray(&r, scene, depth + 1);
   }
 
   out_color = vec3_add(out_color, surface);
@@ -21,8 +21,10 @@
 #ifndef PI
 #define PI 3.14159265359
 #endif
-#define EPSILON 1e-8
+#define EPSILON 1e-8  /* parallel ray tests, secondary rays leave through offset_ray_origin() */
 #define MAX_DEPTH 5
+#define DIFFUSE_WEIGHT 0.5  /* albedo / (2 PI) per steradian over the cos / PI of random_cosine_direction() */
+#define GAMMA 5.0
 #define MONTE_CARLO_SAMPLES 1
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -55,6 +57,44 @@
 #define M_REFRACTION        ((uint)1 << 3)
 #define M_CHECKERED         ((uint)1 << 4)
 
+#define BVH_MAX_LEAF_SIZE   8
+#define BVH_NUM_BINS        16
+#define BVH_STACK_SIZE      128
+#define BVH_TRAVERSAL_COST  1.0
+#define BVH_INTERSECT_COST  0.5
+#define MORTON_BITS         21
+#define BVH_REBUILD_RATIO   1.5  /* rebuild once refitting made the tree this much worse */
+#define BVH8_WIDTH          8
+#define PACKET_WIDTH        4    /* camera ray packets cover PACKET_WIDTH x PACKET_HEIGHT pixels */
+#define PACKET_HEIGHT       2
+#define PACKET_SIZE         (PACKET_WIDTH * PACKET_HEIGHT)
+#define GRID_DENSITY        2.0  /* target cells per primitive */
+#define GRID_MAX_RESOLUTION 256
+#define GRID_LARGE_FACTOR   8.0  /* primitives this much larger than the median skip the grid */
+#define TRIANGLE_BLOCK_SIZE 8    /* one AVX-512 register of doubles or AVX2 register of floats per coordinate */
+#define OFFSET_ORIGIN       (1.0 / 32)  /* closer to the origin points are offset by a fixed amount */
+#ifdef SINGLE_PRECISION
+#define OFFSET_INT_SCALE    256.0       /* ulps per unit of normal */
+#define OFFSET_FLOAT_SCALE  (1.0 / 65536)
+#else
+#define OFFSET_INT_SCALE    (256.0 * (1 << 29))  /* same relative offset as in single precision */
+#define OFFSET_FLOAT_SCALE  (1.0 / 65536 / (1 << 29))
+#endif
+
+/* x86 builds carry AVX2 and AVX-512 variants of the hot kernels, init_kernels() picks one set at startup */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_KERNELS
+#define TARGET_AVX2         __attribute__((target("avx2")))
+#define TARGET_AVX512       __attribute__((target("avx512f")))
+#endif
+
+/* plain C loops the compiler vectorizes, one clone per ISA resolved by the loader */
+#if defined(HAVE_X86_KERNELS) && defined(__linux__)
+#define MULTIVERSION        __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define MULTIVERSION
+#endif
+
 /*==================[type definitions]======================================*/
 
 typedef uint32_t uint;
@@ -65,103 +105,370 @@ typedef struct
 {
   uint flags;
   vec3 color, emission;
-  double ka, ks, kd;
 } Material;
 
 typedef struct
 {
   vec3 center;
-  double radius;
+  REAL radius;
 } Sphere;
 
+typedef struct { vec3 min, max; } AABB;
+
+typedef struct
+{
+  AABB bounds;
+  uint left_first;  /* first child for interior nodes, first index for leaves */
+  uint count;       /* number of primitives, 0 for interior nodes */
+} BVHNode;
+
+typedef struct
+{
+  BVHNode *nodes;
+  uint *indices;    /* leaf ranges point into this primitive permutation */
+  size_t num_nodes, num_indices;
+  double build_cost;  /* SAH cost right after the last full build */
+  void *mapping;      /* cache file backing nodes and indices, NULL when malloc'ed */
+  size_t mapping_size;
+} BVH;
+
+/* 80 bytes, child boxes are quantized to 8 bits relative to the node box */
+typedef struct
+{
+  float origin[3];                /* lower corner of the node box */
+  int8_t exponent[3];             /* child box grid spacing is 2^exponent per axis */
+  uint8_t internal_mask;          /* bit i is set if child i is an interior node */
+  uint child_base;                /* interior children are stored consecutively from here */
+  uint primitive_base;            /* leaf children reference consecutive indices from here */
+  uint8_t count[BVH8_WIDTH];      /* primitives per leaf child, 0 for interior or empty slots */
+  uint8_t qmin[3][BVH8_WIDTH];
+  uint8_t qmax[3][BVH8_WIDTH];
+} BVH8Node;
+
+typedef struct
+{
+  BVH8Node *nodes;
+  uint *indices;
+  size_t num_nodes, num_indices;
+} BVH8;
+
+/* structure of arrays copy of the scene spheres, indexed by object id */
+typedef struct
+{
+  REAL *center_x, *center_y, *center_z;
+  REAL *radius2;      /* -REAL_MAX for objects that are not spheres */
+  size_t count;
+} SphereBuffer;
+
+/* 576 bytes, 288 in single precision, structure of arrays for TRIANGLE_BLOCK_SIZE triangles with precomputed edges */
+typedef struct
+{
+  REAL v0[3][TRIANGLE_BLOCK_SIZE];
+  REAL edge1[3][TRIANGLE_BLOCK_SIZE];
+  REAL edge2[3][TRIANGLE_BLOCK_SIZE];
+} TriangleBlock;
+
+/* mesh triangles in BVH leaf order, slot s is lane s % 8 of block s / 8 */
+typedef struct
+{
+  TriangleBlock *blocks;
+  uint *ids;        /* triangle index of every slot */
+  size_t num_blocks;
+} TriangleBuffer;
+
+/* uniform grid, cell c holds items[cell_start[c] .. cell_start[c + 1]) */
+typedef struct
+{
+  AABB bounds;
+  vec3 cell_size;
+  int res[3];
+  uint *cell_start;
+  uint *items;
+  uint *large;      /* primitives too big to bin, tested by every ray */
+  size_t num_cells, num_items, num_large;
+} Grid;
+
 typedef struct
 {
   size_t num_triangles;
   Vertex *vertices;
+  BVH bvh;          /* built by init_scene() over the triangles, leaves index slots of triangles */
+  BVH8 wide;        /* only built for ACCEL_BVH8 */
+  TriangleBuffer triangles;
 } TriangleMesh;
 
-typedef union
+typedef struct
 {
-  TriangleMesh *mesh;
-  Sphere *sphere;
-} Geometry;
+  mat4 object_to_world;
+  mat4 world_to_object;
+} Transform;
+
+typedef enum
+{
+  BVH_SAH,    /* binned surface area heuristic, best tree quality */
+  BVH_LBVH,   /* parallel morton code build, fastest build time */
+} BVHBuilder;
+
+typedef enum
+{
+  ACCEL_BVH,  /* binary BVH */
+  ACCEL_BVH8, /* compressed 8-wide BVH collapsed from the binary one */
+  ACCEL_GRID, /* uniform grid over the scene objects, meshes keep their BVH */
+} AccelType;
+
+typedef enum
+{
+  INTEGRATOR_RECURSIVE, /* trace_path(), one sample depth first at a time */
+  INTEGRATOR_WAVEFRONT, /* render_wavefront(), queues of paths one stage at a time, camera rays in packets */
+} Integrator;
+
+typedef enum
+{
+  SAMPLER_RANDOM, /* independent PCG32 numbers for every draw */
+  SAMPLER_SOBOL,  /* Owen scrambled Sobol points, one shuffled 2D set per draw */
+  SAMPLER_BLUE_NOISE, /* Sobol points shifted per pixel by a blue noise tile, for previews at a few samples */
+} SamplerType;
+
+typedef enum
+{
+  PIXEL_JITTER,     /* the first 2D draw of the sampler */
+  PIXEL_STRATIFIED, /* one jittered sample per cell of a near square grid */
+  PIXEL_CMJ,        /* correlated multi-jittered, stratified in the grid and in x and y alone */
+} PixelPattern;
 
 typedef enum
 {
   GEOMETRY_SPHERE,
   GEOMETRY_MESH,
+  GEOMETRY_PLANE,   /* infinite, through center with normal */
+  GEOMETRY_QUAD,    /* parallelogram spanned by edge_u and edge_v from the corner at center */
+  GEOMETRY_BOX,     /* axis aligned, center and half size in extent */
 } GeometryType;
 
-/*
-typedef struct
-{
-  GeometryType type;
-  Material material;
-  Geometry geometry;
-} Object;
-*/
-
 typedef struct 
 {
+  GeometryType type;
   uint flags;
-  double radius;
+  REAL radius;
   vec3 center;
   vec3 color;
   vec3 emission;
+  TriangleMesh *mesh;         /* shared between instances */
+  const Transform *transform; /* optional, places a mesh instance in the world */
+  vec3 normal;                /* planes */
+  vec3 edge_u, edge_v;        /* quads */
+  vec3 extent;                /* boxes */
 } Object;
 
+/* the part of an Object traversal touches, shading data lives in Scene.materials */
+typedef struct
+{
+  GeometryType type;
+  vec3 center;
+  union
+  {
+    REAL radius;
+    vec3 normal;
+    vec3 extent;
+    vec3 edge[2];
+    struct { TriangleMesh *mesh; const Transform *transform; } instance;
+  } shape;
+} Geometry;
+
 typedef struct
 {
-  double t, u, v;
+  REAL t, u, v;
   vec3 point;
   vec3 normal;
   uint object_id;
+  uint primitive_id;  /* triangle index for meshes */
 } Hit;
 
+/* tests a leaf worth of primitives against ray, only reports hits closer than hit->t */
+typedef bool (*IntersectPrimitives)(const Ray *ray, const uint *primitives, uint count, const void *data, Hit *hit);
+
+typedef enum
+{
+  ISA_SCALAR,
+  ISA_AVX2,
+  ISA_AVX512,
+} Isa;
+
+/* variants of the hand vectorized kernels in use, see init_kernels() */
+typedef struct
+{
+  Isa isa;
+  bool (*intersect_spheres)(const SphereBuffer *spheres, const Ray *ray, const uint *ids, uint count, Hit *hit);
+  bool (*intersect_triangles)(const TriangleBuffer *triangles, const Ray *ray, uint first, uint count, Hit *hit);
+  bool (*bvh8_intersect)(const BVH8 *wide, const Ray *ray, IntersectPrimitives intersect_primitives, const void *data, Hit *hit, bool any_hit);
+} Kernels;
+
+typedef struct
+{
+  Object *objects;
+  size_t num_objects;
+  Geometry *geometry;   /* per object, indexed like objects and Hit.object_id */
+  Material *materials;  /* per object, only read by the shading code */
+  BVH bvh;          /* not built for ACCEL_GRID */
+  BVH8 wide;
+  Grid grid;        /* only built for ACCEL_GRID */
+  uint *unbounded;  /* planes, tested before traversing the BVH */
+  size_t num_unbounded;
+  SphereBuffer spheres;
+} Scene;
+
 typedef struct
 {
   vec3 position, horizontal, vertical, lower_left_corner;
 } Camera;
 
+/* random numbers for one sample of one pixel, see rng_seed() */
+typedef struct { uint64_t state; } Rng;
+
+/* the draws of one sample of one pixel, see sampler_seed() */
+typedef struct
+{
+  SamplerType type;
+  uint x, y;          /* pixel */
+  uint index;         /* sample within the pixel */
+  uint dimension;     /* next draw of the sample */
+  uint64_t seed;      /* hashed frame seed, and pixel unless the draws have to line up across pixels */
+  Rng rng;            /* SAMPLER_RANDOM draws from here */
+} Sampler;
+
 typedef struct
 {
   vec3 background;
   char *result, *obj;
-  int width, height, samples;
+  char *cache;        /* directory for mesh BVH cache files, NULL disables caching */
+  int width, height, samples, instances;
+  BVHBuilder builder;
+  AccelType accel;
+  Isa isa;            /* widest kernels to use, capped by what the CPU supports */
+  Integrator integrator;
+  SamplerType sampler;
+  PixelPattern pixel; /* where the camera samples of a pixel go, any sample count */
+  uint64_t seed;      /* frame seed, with the pixel and sample index it picks every random number of a sample */
+  bool sort_rays;     /* wavefront only, reorders bounce rays with sort_rays() before tracing them */
 } Options;
 
 /*==================[external function declarations]========================*/
 
 double random_double();
 double random_range(double, double);
+Rng rng_seed(uint64_t seed, uint64_t pixel, uint64_t sample);
+uint32_t rng_next(Rng *rng);
+double rng_double(Rng *rng);
+double rng_range(Rng *rng, double min, double max);
+void init_sampler(SamplerType type);
+Sampler sampler_seed(SamplerType type, uint64_t seed, uint x, uint y, uint sample);
+double sample_1d(Sampler *sampler);
+void sample_2d(Sampler *sampler, double *u, double *v);
+void sample_pixel(Sampler *sampler, PixelPattern pattern, uint samples, double *du, double *dv);
 
 vec3 point_at(const Ray *ray, double t);
+vec3 offset_ray_origin(vec3 point, vec3 normal);
 
 vec3 calculate_surface_normal(vec3 v0, vec3 v1, vec3 v2);
 
-bool intersect_sphere(const Ray *ray, vec3 center, double radius, Hit *hit);
+bool intersect_sphere(const Ray *ray, vec3 center, REAL radius, Hit *hit);
+bool intersect_plane(const Ray *ray, vec3 point, vec3 normal, Hit *hit);
+bool intersect_quad(const Ray *ray, vec3 corner, vec3 edge_u, vec3 edge_v, Hit *hit);
+bool intersect_box(const Ray *ray, vec3 center, vec3 extent, Hit *hit);
 bool intersect_triangle(const Ray *ray, Vertex vertex0, Vertex vertex1, Vertex vertex2, Hit *hit);
 
-#if 0
-mat4 scale(vec3);
-mat4 rotate(vec3);
-mat4 translate(vec3);
-#endif
+void scale(mat4 m, vec3 v);
+void rotate(mat4 m, vec3 v);
+void translate(mat4 m, vec3 v);
+bool init_transform(Transform *transform, mat4 object_to_world);
+
+double mix(double a, double b, double mix);
+vec3 random_on_unit_sphere(Sampler *sampler);
+vec3 random_cosine_direction(vec3 normal, Sampler *sampler);
+Ray get_camera_ray(const Camera *camera, double u, double v);
+Ray spawn_ray(const Hit *hit, vec3 direction);
+vec3 reflect(const vec3 In, const vec3 N);
+vec3 refract(const vec3 In, const vec3 N, double iot);
+vec3 checkered_texture(vec3 color, double u, double v, double M);
 
 void print_v(const char* msg, const vec3 v);
 void print_m(const mat4 m);
 
 void init_camera(Camera *camera, vec3 position, vec3 target, Options *options);
 
-void render(uint8_t *framebuffer, Object *objects, size_t n_objects, Camera *camera, Options *options);
+void init_scene(Scene *scene, Object *objects, size_t num_objects, Options *options);
+bool update_scene(Scene *scene, Options *options);
+void free_scene(Scene *scene);
+
+bool intersect(const Ray *ray, const Scene *scene, Hit *hit);
+bool occluded(const Ray *ray, const Scene *scene, REAL max_distance);
+uint intersect_packet(const Ray *rays, uint active, const Scene *scene, Hit *hits);
+
+void render(float *accumulation, const Scene *scene, Camera *camera, Options *options);
+void render_wavefront(float *accumulation, const Scene *scene, Camera *camera, Options *options);
+void sort_rays(const Ray *rays, size_t n, uint64_t *keys, uint *order);
+void resolve(uint8_t *framebuffer, const float *accumulation, size_t num_pixels, uint samples);
+
+AABB aabb_empty();
+AABB aabb_union(AABB a, AABB b);
+double aabb_area(AABB box);
+
+void bvh_build(BVH *bvh, const AABB *bounds, size_t n, BVHBuilder builder);
+void bvh_refit(BVH *bvh, const AABB *bounds);
+double bvh_cost(const BVH *bvh);
+uint64_t morton_code(vec3 p);
+void radix_sort(uint64_t *keys, uint *values, size_t n);
+void bvh_free(BVH *bvh);
+uint bvh_intersect_packet(const BVH *bvh, const Ray *rays, uint active, IntersectPrimitives intersect_primitives, const void *data, Hit *hits);
+bool bvh_intersect(const BVH *bvh, const Ray *ray, IntersectPrimitives intersect_primitives, const void *data, Hit *hit, bool any_hit);
+
+uint64_t bvh_cache_key(const AABB *bounds, size_t n, BVHBuilder builder);
+bool bvh_cache_load(BVH *bvh, const char *path, uint64_t key);
+bool bvh_cache_save(const BVH *bvh, const char *path, uint64_t key);
+void bvh_cache_unmap(BVH *bvh);
+
+void grid_build(Grid *grid, const AABB *bounds, size_t n);
+void grid_free(Grid *grid);
+bool grid_intersect(const Grid *grid, const Ray *ray, IntersectPrimitives intersect_primitives, const void *data, Hit *hit, bool any_hit);
+
+void sphere_buffer_build(SphereBuffer *spheres, const Object *objects, size_t n);
+void sphere_buffer_free(SphereBuffer *spheres);
+bool intersect_spheres(const SphereBuffer *spheres, const Ray *ray, const uint *ids, uint count, Hit *hit);
+
+void triangle_buffer_build(TriangleBuffer *triangles, const Vertex *vertices, BVH *bvh);
+void triangle_buffer_free(TriangleBuffer *triangles);
+bool intersect_triangles(const TriangleBuffer *triangles, const Ray *ray, uint first, uint count, Hit *hit);
+
+void bvh8_build(BVH8 *wide, const BVH *bvh);
+void bvh8_free(BVH8 *wide);
+bool bvh8_intersect(const BVH8 *wide, const Ray *ray, IntersectPrimitives intersect_primitives, const void *data, Hit *hit, bool any_hit);
+
+Isa cpu_isa();
+void init_kernels(Isa max_isa);
+const char *isa_name(Isa isa);
+
+bool intersect_spheres_scalar(const SphereBuffer *spheres, const Ray *ray, const uint *ids, uint count, Hit *hit);
+bool intersect_triangles_scalar(const TriangleBuffer *triangles, const Ray *ray, uint first, uint count, Hit *hit);
+bool bvh8_intersect_scalar(const BVH8 *wide, const Ray *ray, IntersectPrimitives intersect_primitives, const void *data, Hit *hit, bool any_hit);
+#ifdef HAVE_X86_KERNELS
+TARGET_AVX2 bool intersect_spheres_avx2(const SphereBuffer *spheres, const Ray *ray, const uint *ids, uint count, Hit *hit);
+TARGET_AVX2 bool intersect_triangles_avx2(const TriangleBuffer *triangles, const Ray *ray, uint first, uint count, Hit *hit);
+TARGET_AVX2 bool bvh8_intersect_avx2(const BVH8 *wide, const Ray *ray, IntersectPrimitives intersect_primitives, const void *data, Hit *hit, bool any_hit);
+#ifndef SINGLE_PRECISION
+TARGET_AVX512 bool intersect_spheres_avx512(const SphereBuffer *spheres, const Ray *ray, const uint *ids, uint count, Hit *hit);
+TARGET_AVX512 bool intersect_triangles_avx512(const TriangleBuffer *triangles, const Ray *ray, uint first, uint count, Hit *hit);
+#endif
+#endif
 
 bool load_obj(const char *filename, TriangleMesh *mesh);
+void free_mesh(TriangleMesh *mesh);
 
 /*==================[external constants]====================================*/
 /*==================[external data]=========================================*/
 
 extern long long ray_count;
 extern long long intersection_test_count;
+extern Kernels kernels;
 
 /*==================[end of file]===========================================*/
 
@@ -0,0 +1,124 @@
+/*==================[inclusions]============================================*/
+
+#include "raytracer.h"
+
+/*==================[macros]================================================*/
+
+/*
+ * The table covers [2^-TONE_MAP_OCTAVES, 1] in TONE_MAP_STEPS buckets per
+ * octave, indexed by the exponent and the top mantissa bits of a float.
+ * Neighbouring 8-bit codes are at least (256/255)^GAMMA - 1, about 2%,
+ * apart while a bucket is 1/TONE_MAP_STEPS wide, so every bucket holds at
+ * most one code boundary. Everything darker than 255^-GAMMA maps to 0.
+ */
+#define TONE_MAP_OCTAVES    40
+#define TONE_MAP_STEPS      64
+#define TONE_MAP_SHIFT      (23 - 6)  /* keeps log2(TONE_MAP_STEPS) mantissa bits */
+#define TONE_MAP_SIZE       (TONE_MAP_OCTAVES * TONE_MAP_STEPS + 1)
+#define TONE_MAP_BASE       ((uint32_t)(127 - TONE_MAP_OCTAVES) << (23 - TONE_MAP_SHIFT))
+#define TONE_MAP_MIN_BITS   ((int32_t)(127 - TONE_MAP_OCTAVES) << 23)  /* 2^-TONE_MAP_OCTAVES */
+#define TONE_MAP_ONE_BITS   ((int32_t)127 << 23)                      /* 1.0f */
+
+/*==================[type definitions]======================================*/
+
+/*
+ * A pixel in bucket i gets code[i], plus one once it reaches threshold[i].
+ * Positive floats order like their bit patterns, thresholds are kept as
+ * bits so the lookup never compares floats.
+ */
+typedef struct
+{
+  uint32_t threshold[TONE_MAP_SIZE];
+  uint32_t code[TONE_MAP_SIZE];
+  bool built;
+} ToneMap;
+
+/*==================[external function declarations]========================*/
+/*==================[internal function declarations]========================*/
+
+static uint8_t gamma_correct(float x);
+static float code_threshold(uint code);
+static void build_tone_map(ToneMap *map);
+
+/*==================[external constants]====================================*/
+/*==================[internal constants]====================================*/
+/*==================[external data]=========================================*/
+/*==================[internal data]=========================================*/
+
+static ToneMap tone_map;
+
+/*==================[external function definitions]=========================*/
+
+/*
+ * Turns the per pixel radiance sums render() left in accumulation into
+ * gamma corrected 8-bit RGB. All channels go through the same branch free
+ * table lookup on the float bits, the loop vectorizes with gathers. Cheap
+ * enough to run again, e.g. to write out a partial image.
+ */
+MULTIVERSION void resolve(uint8_t *restrict framebuffer, const float *restrict accumulation, size_t num_pixels, uint samples)
+{
+  if (!tone_map.built)
+    build_tone_map(&tone_map);
+
+  const float scale = 1.0f / samples;
+  for (size_t i = 0; i < 3 * num_pixels; i++)
+  {
+    float x = accumulation[i] * scale;
+
+    /* clamping the bits sends negatives to black and NaN to white */
+    int32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    bits = bits > TONE_MAP_MIN_BITS ? bits : TONE_MAP_MIN_BITS;
+    bits = bits < TONE_MAP_ONE_BITS ? bits : TONE_MAP_ONE_BITS;
+
+    uint32_t index = ((uint32_t)bits >> TONE_MAP_SHIFT) - TONE_MAP_BASE;
+    framebuffer[i] = (uint8_t)(tone_map.code[index] + ((uint32_t)bits >= tone_map.threshold[index]));
+  }
+}
+
+/*==================[internal function definitions]=========================*/
+
+/* the reference the table reproduces exactly */
+uint8_t gamma_correct(float x)
+{
+  return (uint8_t)(255.0 * CLAMP(pow((double)x, 1 / GAMMA)));
+}
+
+/* smallest float gamma_correct() maps to code or above */
+float code_threshold(uint code)
+{
+  float x = (float)pow(code / 255.0, GAMMA);
+  while (x > 0 && gamma_correct(nextafterf(x, 0)) >= code)
+    x = nextafterf(x, 0);
+  while (gamma_correct(x) < code)
+    x = nextafterf(x, INFINITY);
+  return x;
+}
+
+void build_tone_map(ToneMap *map)
+{
+  uint32_t thresholds[256];
+  for (uint k = 1; k < 256; k++)
+  {
+    float x = code_threshold(k);
+    memcpy(&thresholds[k], &x, sizeof(x));
+  }
+  assert(thresholds[1] > (uint32_t)TONE_MAP_MIN_BITS);
+
+  uint code = 0;
+  for (uint i = 0; i < TONE_MAP_SIZE; i++)
+  {
+    uint32_t start = (i + TONE_MAP_BASE) << TONE_MAP_SHIFT;
+    uint32_t end = start + (1u << TONE_MAP_SHIFT);
+
+    while (code < 255 && thresholds[code + 1] <= start)
+      code++;
+
+    map->code[i] = code;
+    map->threshold[i] = code < 255 && thresholds[code + 1] < end ? thresholds[code + 1] : UINT32_MAX;
+    assert(code >= 254 || thresholds[code + 2] >= end);
+  }
+  map->built = true;
+}
+
+/*==================[end of file]===========================================*/
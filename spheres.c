@@ -0,0 +1,269 @@
+/*==================[inclusions]============================================*/
+
+#include "raytracer.h"
+
+#ifdef HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/*==================[macros]================================================*/
+
+/* marks objects that are not spheres, no ray can pass d2 <= radius2 */
+#define NOT_A_SPHERE (-REAL_MAX)
+
+/*==================[type definitions]======================================*/
+/*==================[external function declarations]========================*/
+/*==================[internal function declarations]========================*/
+
+static bool closest_lane(const REAL *t, uint mask, uint base, const uint *ids, Hit *hit);
+
+/*==================[external constants]====================================*/
+/*==================[internal constants]====================================*/
+/*==================[external data]=========================================*/
+/*==================[internal data]=========================================*/
+/*==================[external function definitions]=========================*/
+
+void sphere_buffer_build(SphereBuffer *spheres, const Object *objects, size_t n)
+{
+  spheres->count = n;
+  spheres->center_x = malloc(sizeof(REAL) * MAX(n, 1));
+  spheres->center_y = malloc(sizeof(REAL) * MAX(n, 1));
+  spheres->center_z = malloc(sizeof(REAL) * MAX(n, 1));
+  spheres->radius2 = malloc(sizeof(REAL) * MAX(n, 1));
+  assert(spheres->center_x != NULL && spheres->center_y != NULL && spheres->center_z != NULL && spheres->radius2 != NULL);
+
+  for (uint i = 0; i < n; i++)
+  {
+    const Object *object = &objects[i];
+    spheres->center_x[i] = object->center.x;
+    spheres->center_y[i] = object->center.y;
+    spheres->center_z[i] = object->center.z;
+    spheres->radius2[i] = object->type == GEOMETRY_SPHERE ? object->radius * object->radius : NOT_A_SPHERE;
+  }
+}
+
+void sphere_buffer_free(SphereBuffer *spheres)
+{
+  free(spheres->center_x);
+  free(spheres->center_y);
+  free(spheres->center_z);
+  free(spheres->radius2);
+  memset(spheres, 0, sizeof(*spheres));
+}
+
+#if defined(HAVE_X86_KERNELS) && defined(SINGLE_PRECISION)
+
+/*
+ * Same arithmetic as intersect_sphere(), eight spheres per iteration. Ids
+ * of objects that are not spheres are skipped. On a hit hit->t and
+ * hit->object_id are set to the closest sphere.
+ */
+TARGET_AVX2 bool intersect_spheres_avx2(const SphereBuffer *spheres, const Ray *ray, const uint *ids, uint count, Hit *hit)
+{
+  const __m256 ox = _mm256_set1_ps(ray->origin.x), oy = _mm256_set1_ps(ray->origin.y), oz = _mm256_set1_ps(ray->origin.z);
+  const __m256 dx = _mm256_set1_ps(ray->direction.x), dy = _mm256_set1_ps(ray->direction.y), dz = _mm256_set1_ps(ray->direction.z);
+  const __m256 zero = _mm256_setzero_ps();
+  bool found = false;
+
+  for (uint base = 0; base < count; base += 8)
+  {
+    uint n = MIN(8, count - base);
+    int lane_ids[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    memcpy(lane_ids, &ids[base], sizeof(uint) * n);
+
+    __m256i index = _mm256_loadu_si256((const __m256i *)lane_ids);
+    __m256 valid = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(n), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+
+    __m256 lx = _mm256_sub_ps(_mm256_mask_i32gather_ps(zero, spheres->center_x, index, valid, 4), ox);
+    __m256 ly = _mm256_sub_ps(_mm256_mask_i32gather_ps(zero, spheres->center_y, index, valid, 4), oy);
+    __m256 lz = _mm256_sub_ps(_mm256_mask_i32gather_ps(zero, spheres->center_z, index, valid, 4), oz);
+    __m256 radius2 = _mm256_mask_i32gather_ps(_mm256_set1_ps(NOT_A_SPHERE), spheres->radius2, index, valid, 4);
+    intersection_test_count += __builtin_popcount(_mm256_movemask_ps(_mm256_cmp_ps(radius2, zero, _CMP_GE_OQ)));
+
+    __m256 tca = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, dx), _mm256_mul_ps(ly, dy)), _mm256_mul_ps(lz, dz));
+    __m256 ll = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, lx), _mm256_mul_ps(ly, ly)), _mm256_mul_ps(lz, lz));
+    __m256 d2 = _mm256_sub_ps(ll, _mm256_mul_ps(tca, tca));
+
+    __m256 hits = _mm256_and_ps(_mm256_cmp_ps(tca, zero, _CMP_GE_OQ), _mm256_cmp_ps(d2, radius2, _CMP_LE_OQ));
+    uint mask = _mm256_movemask_ps(_mm256_and_ps(hits, valid));
+    if (mask == 0)
+      continue;
+
+    __m256 thc = _mm256_sqrt_ps(_mm256_sub_ps(radius2, d2));
+    __m256 t0 = _mm256_sub_ps(tca, thc);
+    __m256 t1 = _mm256_add_ps(tca, thc);
+    __m256 t = _mm256_blendv_ps(t0, t1, _mm256_cmp_ps(t0, zero, _CMP_LT_OQ));
+    mask &= _mm256_movemask_ps(_mm256_cmp_ps(t, zero, _CMP_GT_OQ));
+
+    float lanes[8];
+    _mm256_storeu_ps(lanes, t);
+    found |= closest_lane(lanes, mask, base, ids, hit);
+  }
+
+  return found;
+}
+
+#elif defined(HAVE_X86_KERNELS)
+
+/*
+ * Same arithmetic as intersect_sphere(), eight spheres per iteration. Ids
+ * of objects that are not spheres are skipped. On a hit hit->t and
+ * hit->object_id are set to the closest sphere.
+ */
+TARGET_AVX512 bool intersect_spheres_avx512(const SphereBuffer *spheres, const Ray *ray, const uint *ids, uint count, Hit *hit)
+{
+  const __m512d ox = _mm512_set1_pd(ray->origin.x), oy = _mm512_set1_pd(ray->origin.y), oz = _mm512_set1_pd(ray->origin.z);
+  const __m512d dx = _mm512_set1_pd(ray->direction.x), dy = _mm512_set1_pd(ray->direction.y), dz = _mm512_set1_pd(ray->direction.z);
+  const __m512d zero = _mm512_setzero_pd();
+  bool found = false;
+
+  for (uint base = 0; base < count; base += 8)
+  {
+    uint n = MIN(8, count - base);
+    int lane_ids[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    memcpy(lane_ids, &ids[base], sizeof(uint) * n);
+
+    __mmask8 valid = (__mmask8)((1u << n) - 1);
+    __m256i index = _mm256_loadu_si256((const __m256i *)lane_ids);
+
+    __m512d lx = _mm512_sub_pd(_mm512_mask_i32gather_pd(zero, valid, index, spheres->center_x, 8), ox);
+    __m512d ly = _mm512_sub_pd(_mm512_mask_i32gather_pd(zero, valid, index, spheres->center_y, 8), oy);
+    __m512d lz = _mm512_sub_pd(_mm512_mask_i32gather_pd(zero, valid, index, spheres->center_z, 8), oz);
+    __m512d radius2 = _mm512_mask_i32gather_pd(_mm512_set1_pd(NOT_A_SPHERE), valid, index, spheres->radius2, 8);
+    intersection_test_count += __builtin_popcount(_mm512_cmp_pd_mask(radius2, zero, _CMP_GE_OQ));
+
+    __m512d tca = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(lx, dx), _mm512_mul_pd(ly, dy)), _mm512_mul_pd(lz, dz));
+    __m512d ll = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(lx, lx), _mm512_mul_pd(ly, ly)), _mm512_mul_pd(lz, lz));
+    __m512d d2 = _mm512_sub_pd(ll, _mm512_mul_pd(tca, tca));
+
+    __mmask8 mask = valid & _mm512_cmp_pd_mask(tca, zero, _CMP_GE_OQ) & _mm512_cmp_pd_mask(d2, radius2, _CMP_LE_OQ);
+    if (mask == 0)
+      continue;
+
+    __m512d thc = _mm512_sqrt_pd(_mm512_sub_pd(radius2, d2));
+    __m512d t0 = _mm512_sub_pd(tca, thc);
+    __m512d t1 = _mm512_add_pd(tca, thc);
+    __m512d t = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(t0, zero, _CMP_LT_OQ), t0, t1);
+    mask &= _mm512_cmp_pd_mask(t, zero, _CMP_GT_OQ);
+
+    double lanes[8];
+    _mm512_storeu_pd(lanes, t);
+    found |= closest_lane(lanes, mask, base, ids, hit);
+  }
+
+  return found;
+}
+
+/*
+ * Same arithmetic as intersect_sphere(), four spheres per iteration. Ids
+ * of objects that are not spheres are skipped. On a hit hit->t and
+ * hit->object_id are set to the closest sphere.
+ */
+TARGET_AVX2 bool intersect_spheres_avx2(const SphereBuffer *spheres, const Ray *ray, const uint *ids, uint count, Hit *hit)
+{
+  const __m256d ox = _mm256_set1_pd(ray->origin.x), oy = _mm256_set1_pd(ray->origin.y), oz = _mm256_set1_pd(ray->origin.z);
+  const __m256d dx = _mm256_set1_pd(ray->direction.x), dy = _mm256_set1_pd(ray->direction.y), dz = _mm256_set1_pd(ray->direction.z);
+  const __m256d zero = _mm256_setzero_pd();
+  bool found = false;
+
+  for (uint base = 0; base < count; base += 4)
+  {
+    uint n = MIN(4, count - base);
+    int lane_ids[4] = {0, 0, 0, 0};
+    memcpy(lane_ids, &ids[base], sizeof(uint) * n);
+
+    __m128i index = _mm_loadu_si128((const __m128i *)lane_ids);
+    __m256d valid = _mm256_castsi256_pd(_mm256_cmpgt_epi64(_mm256_set1_epi64x(n), _mm256_setr_epi64x(0, 1, 2, 3)));
+
+    __m256d lx = _mm256_sub_pd(_mm256_mask_i32gather_pd(zero, spheres->center_x, index, valid, 8), ox);
+    __m256d ly = _mm256_sub_pd(_mm256_mask_i32gather_pd(zero, spheres->center_y, index, valid, 8), oy);
+    __m256d lz = _mm256_sub_pd(_mm256_mask_i32gather_pd(zero, spheres->center_z, index, valid, 8), oz);
+    __m256d radius2 = _mm256_mask_i32gather_pd(_mm256_set1_pd(NOT_A_SPHERE), spheres->radius2, index, valid, 8);
+    intersection_test_count += __builtin_popcount(_mm256_movemask_pd(_mm256_cmp_pd(radius2, zero, _CMP_GE_OQ)));
+
+    __m256d tca = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(lx, dx), _mm256_mul_pd(ly, dy)), _mm256_mul_pd(lz, dz));
+    __m256d ll = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(lx, lx), _mm256_mul_pd(ly, ly)), _mm256_mul_pd(lz, lz));
+    __m256d d2 = _mm256_sub_pd(ll, _mm256_mul_pd(tca, tca));
+
+    __m256d hits = _mm256_and_pd(_mm256_cmp_pd(tca, zero, _CMP_GE_OQ), _mm256_cmp_pd(d2, radius2, _CMP_LE_OQ));
+    uint mask = _mm256_movemask_pd(_mm256_and_pd(hits, valid));
+    if (mask == 0)
+      continue;
+
+    __m256d thc = _mm256_sqrt_pd(_mm256_sub_pd(radius2, d2));
+    __m256d t0 = _mm256_sub_pd(tca, thc);
+    __m256d t1 = _mm256_add_pd(tca, thc);
+    __m256d t = _mm256_blendv_pd(t0, t1, _mm256_cmp_pd(t0, zero, _CMP_LT_OQ));
+    mask &= _mm256_movemask_pd(_mm256_cmp_pd(t, zero, _CMP_GT_OQ));
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, t);
+    found |= closest_lane(lanes, mask, base, ids, hit);
+  }
+
+  return found;
+}
+
+#endif
+
+bool intersect_spheres_scalar(const SphereBuffer *spheres, const Ray *ray, const uint *ids, uint count, Hit *hit)
+{
+  bool found = false;
+
+  for (uint i = 0; i < count; i++)
+  {
+    uint id = ids[i];
+    REAL radius2 = spheres->radius2[id];
+    if (radius2 < 0)
+      continue;
+
+    intersection_test_count++;
+    REAL lx = spheres->center_x[id] - ray->origin.x;
+    REAL ly = spheres->center_y[id] - ray->origin.y;
+    REAL lz = spheres->center_z[id] - ray->origin.z;
+
+    REAL tca = lx * ray->direction.x + ly * ray->direction.y + lz * ray->direction.z;
+    if (tca < 0)
+      continue;
+    REAL d2 = lx * lx + ly * ly + lz * lz - tca * tca;
+    if (d2 > radius2)
+      continue;
+
+    REAL thc = sqrt(radius2 - d2);
+    REAL t = tca - thc < 0 ? tca + thc : tca - thc;
+    if (t > 0 && t < hit->t)
+    {
+      hit->t = t;
+      hit->object_id = id;
+      found = true;
+    }
+  }
+
+  return found;
+}
+
+/* runs the variant init_kernels() picked for this CPU */
+bool intersect_spheres(const SphereBuffer *spheres, const Ray *ray, const uint *ids, uint count, Hit *hit)
+{
+  return kernels.intersect_spheres(spheres, ray, ids, count, hit);
+}
+
+/*==================[internal function definitions]=========================*/
+
+/* lanes are visited in order so ties resolve like the scalar loop */
+bool closest_lane(const REAL *t, uint mask, uint base, const uint *ids, Hit *hit)
+{
+  bool found = false;
+  for (uint lane = 0; mask != 0; lane++, mask >>= 1)
+  {
+    if ((mask & 1) && t[lane] < hit->t)
+    {
+      hit->t = t[lane];
+      hit->object_id = ids[base + lane];
+      found = true;
+    }
+  }
+  return found;
+}
+
+/*==================[end of file]===========================================*/
@@ -7,6 +7,7 @@
 #include <float.h>
 #include <stdint.h>
 #include <string.h>
+#include <omp.h>
 
 #ifdef __unix__
 #define TERM_RED "\x1B[31m"
@@ -54,6 +55,22 @@ static int _test_check(int cond, const char *filename, int line, const char *exp
   return test_failures_so_far;
 }
 
+/* the vector helpers have to agree with the plain formulas bit for bit */
+void test_vector()
+{
+  vec3 a = {0.1, -2.5, 3.3}, b = {-1.7, 0.2, 4.9};
+  TEST_CHECK(vec3_dot(a, b) == a.x * b.x + a.y * b.y + a.z * b.z);
+  TEST_CHECK(vec3_equal(vec3_min(a, b), (vec3){-1.7, -2.5, 3.3}));
+  TEST_CHECK(vec3_equal(vec3_max(a, b), (vec3){0.1, 0.2, 4.9}));
+  TEST_CHECK(!vec3_equal(a, (vec3){0.1, -2.5, 3.4}));
+
+  vec3 c = vec3_cross(a, b);
+  TEST_CHECK(c.x == a.y * b.z - a.z * b.y && c.y == a.z * b.x - a.x * b.z && c.z == a.x * b.y - a.y * b.x);
+
+  vec3 n = vec3_normalize(vec3_sub(a, b));
+  TEST_CHECK(fabs(vec3_length(n) - 1) < 1e-6);
+}
+
 void test_normal()
 {
   {
@@ -79,8 +96,801 @@ void test_normal()
   }
 }
 
+static bool intersect_brute_force(const Ray *ray, const Object *objects, size_t n, Hit *hit)
+{
+  bool found = false;
+  for (uint i = 0; i < n; i++)
+  {
+    Hit local;
+    if (intersect_sphere(ray, objects[i].center, objects[i].radius, &local) && local.t < hit->t)
+    {
+      hit->t = local.t;
+      hit->object_id = i;
+      found = true;
+    }
+  }
+  return found;
+}
+
+static bool matches_brute_force(const Scene *scene, const Object *objects, size_t n)
+{
+  bool all_equal = true;
+  for (uint i = 0; i < 1000; i++)
+  {
+    vec3 origin = {random_range(-60, 60), random_range(-60, 60), random_range(-60, 60)};
+    vec3 target = {random_range(-10, 10), random_range(-10, 10), random_range(-10, 10)};
+    Ray ray = {origin, vec3_normalize(vec3_sub(target, origin))};
+
+    Hit expected = {.t = REAL_MAX}, actual = {.t = REAL_MAX};
+    bool hit_expected = intersect_brute_force(&ray, objects, n, &expected);
+    bool hit_actual = intersect(&ray, scene, &actual);
+
+    if (hit_expected != hit_actual || (hit_expected && (expected.object_id != actual.object_id || expected.t != actual.t)))
+      all_equal = false;
+  }
+  return all_equal;
+}
+
+static void random_spheres(Object *objects, size_t n)
+{
+  for (uint i = 0; i < n; i++)
+  {
+    objects[i] = (Object){
+      .center = {random_range(-50, 50), random_range(-50, 50), random_range(-50, 50)},
+      .radius = random_range(0.5, 3),
+    };
+  }
+}
+
+void test_bvh(BVHBuilder builder, AccelType accel)
+{
+  const size_t n = 500;
+  Object objects[500];
+  Options options = {.builder = builder, .accel = accel};
+
+  srand(42);
+  random_spheres(objects, n);
+
+  Scene scene;
+  init_scene(&scene, objects, n, &options);
+  TEST_CHECK(matches_brute_force(&scene, objects, n));
+  free_scene(&scene);
+}
+
+void test_primitives()
+{
+  Ray down = {{0.5, 5, 0.25}, {0, -1, 0}};
+  Hit hit;
+
+  TEST_CHECK(intersect_plane(&down, (vec3){0, -1, 0}, (vec3){0, 1, 0}, &hit) && hit.t == 6);
+  TEST_CHECK(intersect_quad(&down, (vec3){0, 0, 0}, (vec3){1, 0, 0}, (vec3){0, 0, 1}, &hit) && hit.t == 5);
+  TEST_CHECK(hit.u == 0.5 && hit.v == 0.25);
+  TEST_CHECK(!intersect_quad(&down, (vec3){1, 0, 0}, (vec3){1, 0, 0}, (vec3){0, 0, 1}, &hit));
+  TEST_CHECK(intersect_box(&down, (vec3){0, 0, 0}, (vec3){1, 1, 1}, &hit) && hit.t == 4);
+
+  Ray inside = {{0, 0, 0}, {0, 0, 1}};
+  TEST_CHECK(intersect_box(&inside, (vec3){0, 0, 0}, (vec3){1, 2, 3}, &hit) && hit.t == 3);
+
+  /* the plane is kept out of the hierarchy but still found, normals face the ray */
+  for (int accel = ACCEL_BVH; accel <= ACCEL_GRID; accel++)
+  {
+    Object objects[] = {
+      {.type = GEOMETRY_PLANE, .center = {0, -1, 0}, .normal = {0, -1, 0}},
+      {.type = GEOMETRY_BOX, .center = {3, 0, 0}, .extent = {1, 1, 1}},
+      {.type = GEOMETRY_QUAD, .center = {-4, 2, -1}, .edge_u = {2, 0, 0}, .edge_v = {0, 0, 2}},
+    };
+    Options options = {.accel = accel};
+    Scene scene;
+    init_scene(&scene, objects, 3, &options);
+
+    hit = (Hit){.t = REAL_MAX};
+    TEST_CHECK(intersect(&down, &scene, &hit) && hit.object_id == 0 && hit.normal.y == 1);
+
+    Ray left = {{10, 0.5, 0}, {-1, 0, 0}};
+    hit = (Hit){.t = REAL_MAX};
+    TEST_CHECK(intersect(&left, &scene, &hit) && hit.object_id == 1 && hit.t == 6 && hit.normal.x == 1);
+
+    Ray up = {{-3, 0, 0}, {0, 1, 0}};
+    hit = (Hit){.t = REAL_MAX};
+    TEST_CHECK(intersect(&up, &scene, &hit) && hit.object_id == 2 && hit.t == 2 && hit.normal.y == -1);
+
+    free_scene(&scene);
+  }
+}
+
+/* odd batch sizes exercise the vector tails, the box must be skipped */
+void test_sphere_buffer()
+{
+  const uint n = 11;
+  Object objects[11];
+  uint ids[11];
+
+  srand(5);
+  random_spheres(objects, n);
+  objects[4] = (Object){.type = GEOMETRY_BOX, .center = {0, 0, 0}, .extent = {100, 100, 100}};
+  for (uint i = 0; i < n; i++)
+    ids[i] = n - 1 - i;
+
+  SphereBuffer spheres;
+  sphere_buffer_build(&spheres, objects, n);
+
+  bool all_equal = true;
+  for (uint i = 0; i < 1000; i++)
+  {
+    vec3 origin = {random_range(-60, 60), random_range(-60, 60), random_range(-60, 60)};
+    vec3 target = objects[rand() % n].center;
+    Ray ray = {origin, vec3_normalize(vec3_sub(target, origin))};
+
+    uint count = 1 + i % n;
+    Hit expected = {.t = REAL_MAX}, actual = {.t = REAL_MAX};
+    for (uint k = 0; k < count; k++)
+    {
+      Hit local;
+      if (objects[ids[k]].type == GEOMETRY_SPHERE && intersect_sphere(&ray, objects[ids[k]].center, objects[ids[k]].radius, &local) && local.t < expected.t)
+      {
+        expected.t = local.t;
+        expected.object_id = ids[k];
+      }
+    }
+
+    bool found = intersect_spheres(&spheres, &ray, ids, count, &actual);
+    if (found != (expected.t < REAL_MAX) || actual.t != expected.t || (found && actual.object_id != expected.object_id))
+      all_equal = false;
+  }
+  TEST_CHECK(all_equal);
+
+  sphere_buffer_free(&spheres);
+}
+
+void test_triangle_buffer()
+{
+  const uint n = 40;
+  Vertex vertices[40 * 3];
+  AABB bounds[40];
+
+  /* texture coordinates chosen so intersect_triangle() reports barycentrics */
+  srand(7);
+  for (uint i = 0; i < n; i++)
+  {
+    vec3 center = {random_range(-10, 10), random_range(-10, 10), random_range(-10, 10)};
+    for (uint k = 0; k < 3; k++)
+      vertices[i * 3 + k].pos = vec3_add(center, VECTOR(random_range(-4, 4), random_range(-4, 4), random_range(-4, 4)));
+    vertices[i * 3 + 0].tex = (vec2){0, 0};
+    vertices[i * 3 + 1].tex = (vec2){1, 0};
+    vertices[i * 3 + 2].tex = (vec2){0, 1};
+
+    const Vertex *v = &vertices[i * 3];
+    bounds[i] = (AABB){vec3_min(v[0].pos, vec3_min(v[1].pos, v[2].pos)), vec3_max(v[0].pos, vec3_max(v[1].pos, v[2].pos))};
+  }
+
+  BVH bvh;
+  TriangleBuffer triangles;
+  bvh_build(&bvh, bounds, n, BVH_SAH);
+  triangle_buffer_build(&triangles, vertices, &bvh);
+
+  bool all_equal = true;
+  for (uint i = 0; i < 200; i++)
+  {
+    vec3 origin = {random_range(-30, 30), random_range(-30, 30), random_range(-30, 30)};
+    vec3 target = vertices[(rand() % n) * 3].pos;
+    Ray ray = {origin, vec3_normalize(vec3_sub(vec3_add(target, VECTOR(1, 1, 1)), origin))};
+
+    for (uint l = 0; l < bvh.num_nodes; l++)
+    {
+      const BVHNode *node = &bvh.nodes[l];
+      if (node->count == 0)
+        continue;
+
+      const uint *slots = &bvh.indices[node->left_first];
+      Hit expected = {.t = REAL_MAX}, actual = {.t = REAL_MAX};
+      for (uint k = 0; k < node->count; k++)
+      {
+        const Vertex *v = &vertices[triangles.ids[slots[k]] * 3];
+        Hit local;
+        if (intersect_triangle(&ray, v[0], v[1], v[2], &local) && local.t < expected.t)
+        {
+          expected = local;
+          expected.primitive_id = triangles.ids[slots[k]];
+        }
+      }
+
+      bool found = intersect_triangles(&triangles, &ray, slots[0], node->count, &actual);
+      if (found != (expected.t < REAL_MAX) || actual.t != expected.t)
+        all_equal = false;
+      else if (found && (actual.primitive_id != expected.primitive_id || actual.u != expected.u || actual.v != expected.v))
+        all_equal = false;
+    }
+  }
+  TEST_CHECK(all_equal);
+
+  triangle_buffer_free(&triangles);
+  bvh_free(&bvh);
+}
+
+/* the hand vectorized kernels run once per instruction set the CPU has */
+void test_kernels(Isa isa)
+{
+  init_kernels(isa);
+  TEST_CHECK(kernels.isa <= isa);
+  TEST_CHECK(isa == ISA_SCALAR || kernels.isa != ISA_SCALAR);
+
+  test_sphere_buffer();
+  test_triangle_buffer();
+  test_bvh(BVH_SAH, ACCEL_BVH8);
+}
+
+/* the tone map table has to match the direct gamma curve, code boundaries included */
+void test_resolve()
+{
+  enum { n = 4096 };
+  static float accumulation[3 * n];
+  static uint8_t pixels[3 * n];
+
+  srand(11);
+  uint i = 0;
+  for (uint k = 1; k < 256; k++)
+    for (int ulps = -3; ulps <= 3; ulps++)
+    {
+      float x = (float)pow(k / 255.0, GAMMA);
+      for (int u = 0; u < abs(ulps); u++)
+        x = nextafterf(x, ulps < 0 ? 0 : INFINITY);
+      accumulation[i++] = x;
+    }
+  accumulation[i++] = 0;
+  accumulation[i++] = 2;
+  accumulation[i++] = NAN;
+  while (i < 3 * n)
+    accumulation[i++] = (float)pow(2, random_range(-45, 1));
+
+  resolve(pixels, accumulation, n, 1);
+
+  bool all_equal = true;
+  for (i = 0; i < 3 * n; i++)
+    all_equal &= pixels[i] == (uint8_t)(255.0 * CLAMP(pow((double)accumulation[i], 1 / GAMMA)));
+  TEST_CHECK(all_equal);
+
+  /* sums are averaged over the samples, negative sums are black */
+  accumulation[0] = 4;
+  accumulation[1] = -1;
+  resolve(pixels, accumulation, 1, 4);
+  TEST_CHECK(pixels[0] == 255 && pixels[1] == 0);
+}
+
+void test_occluded()
+{
+  Object objects[] = {
+    {.center = {0, 0, -5}, .radius = 1},
+    {.type = GEOMETRY_PLANE, .center = {0, 0, -20}, .normal = {0, 0, 1}},
+  };
+  Ray ray = {{0, 0, 0}, {0, 0, -1}};
+
+  for (int accel = ACCEL_BVH; accel <= ACCEL_GRID; accel++)
+  {
+    Options options = {.accel = accel};
+    Scene scene;
+    init_scene(&scene, objects, 2, &options);
+
+    TEST_CHECK(occluded(&ray, &scene, REAL_MAX));
+    TEST_CHECK(occluded(&ray, &scene, 4.5));
+    TEST_CHECK(!occluded(&ray, &scene, 3.5));
+
+    /* the plane alone is beyond the light */
+    Ray past = {{5, 0, 0}, {0, 0, -1}};
+    TEST_CHECK(occluded(&past, &scene, 25) && !occluded(&past, &scene, 15));
+
+    free_scene(&scene);
+  }
+}
+
+/* a plane in the middle of the list stays out of the wide BVH but keeps its id */
+void test_unbounded(BVHBuilder builder)
+{
+  const uint n = 41, plane = 20;
+  Object objects[41];
+  Options options = {.builder = builder, .accel = ACCEL_BVH8};
+
+  for (uint i = 0, k = 0; i < n; i++)
+  {
+    if (i == plane)
+      objects[i] = (Object){.type = GEOMETRY_PLANE, .center = {0, -3, 0}, .normal = {0, 1, 0}};
+    else
+    {
+      objects[i] = (Object){.center = {(k % 8) * 3, 0, (k / 8) * 3}, .radius = 1};
+      k++;
+    }
+  }
+
+  Scene scene;
+  init_scene(&scene, objects, n, &options);
+  TEST_CHECK(scene.bvh.num_indices == n - 1 && scene.wide.num_nodes > 1);
+  for (uint i = 0; i < scene.bvh.num_indices; i++)
+    TEST_CHECK(scene.bvh.indices[i] != plane);
+
+  for (uint i = 0; i < n; i++)
+  {
+    if (i == plane)
+      continue;
+    Ray down = {vec3_add(objects[i].center, (vec3){0, 5, 0}), {0, -1, 0}};
+    Hit hit = {.t = REAL_MAX};
+    TEST_CHECK(intersect(&down, &scene, &hit) && hit.object_id == i && hit.t == 4);
+
+    /* between the spheres the ray goes on to the plane */
+    Ray gap = {vec3_add(objects[i].center, (vec3){1.5, 5, 1.5}), {0, -1, 0}};
+    hit = (Hit){.t = REAL_MAX};
+    TEST_CHECK(intersect(&gap, &scene, &hit) && hit.object_id == plane && hit.t == 8 && hit.normal.y == 1);
+    TEST_CHECK(occluded(&gap, &scene, 9) && !occluded(&gap, &scene, 7));
+  }
+  free_scene(&scene);
+}
+
+/* a floor sized sphere must not stretch the grid over the whole scene */
+void test_grid()
+{
+  const size_t n = 501;
+  Object objects[501];
+  Options options = {.accel = ACCEL_GRID};
+
+  srand(3);
+  random_spheres(objects, n - 1);
+  objects[n - 1] = (Object){.center = {0, -1060, 0}, .radius = 1000};
+
+  Scene scene;
+  init_scene(&scene, objects, n, &options);
+  TEST_CHECK(scene.grid.num_large == 1 && scene.grid.large[0] == n - 1);
+  TEST_CHECK(scene.grid.bounds.min.y > -60);
+  TEST_CHECK(matches_brute_force(&scene, objects, n));
+
+  objects[0].center = vec3_add(objects[0].center, (vec3){5, 5, 5});
+  TEST_CHECK(update_scene(&scene, &options));
+  TEST_CHECK(matches_brute_force(&scene, objects, n));
+  free_scene(&scene);
+}
+
+void test_packet(AccelType accel)
+{
+  const size_t n = 500;
+  Object objects[500];
+  Options options = {.accel = accel};
+
+  srand(13);
+  random_spheres(objects, n);
+  objects[0] = (Object){.type = GEOMETRY_PLANE, .center = {0, -55, 0}, .normal = {0, 1, 0}};
+
+  Scene scene;
+  init_scene(&scene, objects, n, &options);
+
+  bool all_equal = true;
+  for (uint p = 0; p < 200; p++)
+  {
+    Ray rays[PACKET_SIZE];
+    Hit hits[PACKET_SIZE];
+    vec3 origin = {random_range(-60, 60), random_range(-60, 60), 70};
+    for (uint i = 0; i < PACKET_SIZE; i++)
+    {
+      vec3 target = {random_range(-20, 20), random_range(-20, 20), random_range(-20, 20)};
+      rays[i] = (Ray){origin, vec3_normalize(vec3_sub(target, origin))};
+    }
+
+    uint active = p % 2 ? (1u << PACKET_SIZE) - 1 : (uint)rand() & ((1u << PACKET_SIZE) - 1);
+    uint found = intersect_packet(rays, active, &scene, hits);
+    all_equal &= (found & ~active) == 0;
+
+    for (uint i = 0; i < PACKET_SIZE; i++)
+    {
+      Hit expected = {.t = REAL_MAX};
+      if (!((active >> i) & 1))
+        continue;
+      bool hit = intersect(&rays[i], &scene, &expected);
+      if (hit != ((found >> i) & 1) || (hit && (hits[i].object_id != expected.object_id || hits[i].t != expected.t || !vec3_equal(hits[i].normal, expected.normal))))
+        all_equal = false;
+    }
+  }
+  TEST_CHECK(all_equal);
+  free_scene(&scene);
+}
+
+void test_refit(BVHBuilder builder)
+{
+  const size_t n = 500;
+  Object objects[500];
+  Options options = {.builder = builder};
+
+  srand(7);
+  random_spheres(objects, n);
+
+  Scene scene;
+  init_scene(&scene, objects, n, &options);
+
+  /* small motion keeps the topology usable */
+  for (uint i = 0; i < n; i++)
+  {
+    objects[i].center = vec3_add(objects[i].center, (vec3){random_range(-1, 1), random_range(-1, 1), random_range(-1, 1)});
+    objects[i].radius *= random_range(0.8, 1.2);
+  }
+  TEST_CHECK(!update_scene(&scene, &options));
+  TEST_CHECK(matches_brute_force(&scene, objects, n));
+
+  /* shuffling everything degrades the tree far enough to rebuild */
+  random_spheres(objects, n);
+  TEST_CHECK(update_scene(&scene, &options));
+  TEST_CHECK(matches_brute_force(&scene, objects, n));
+
+  free_scene(&scene);
+}
+
+void test_cache()
+{
+  const size_t n = 500;
+  Object objects[500];
+  AABB bounds[500];
+  const char *path = "bin/test_cache.bvh";
+
+  srand(11);
+  random_spheres(objects, n);
+  for (uint i = 0; i < n; i++)
+  {
+    vec3 r = {objects[i].radius, objects[i].radius, objects[i].radius};
+    bounds[i] = (AABB){vec3_sub(objects[i].center, r), vec3_add(objects[i].center, r)};
+  }
+
+  BVH built, cached;
+  uint64_t key = bvh_cache_key(bounds, n, BVH_SAH);
+  bvh_build(&built, bounds, n, BVH_SAH);
+  TEST_ASSERT(bvh_cache_save(&built, path, key));
+
+  TEST_CHECK(!bvh_cache_load(&cached, path, bvh_cache_key(bounds, n, BVH_LBVH)));
+  TEST_ASSERT(bvh_cache_load(&cached, path, key));
+  TEST_CHECK(cached.mapping != NULL);
+  TEST_CHECK(cached.num_nodes == built.num_nodes && cached.num_indices == built.num_indices);
+  TEST_CHECK(memcmp(cached.nodes, built.nodes, sizeof(*built.nodes) * built.num_nodes) == 0);
+  TEST_CHECK(memcmp(cached.indices, built.indices, sizeof(*built.indices) * built.num_indices) == 0);
+
+  /* the private mapping can be refitted without touching the file */
+  bounds[0].max = vec3_add(bounds[0].max, (vec3){1, 1, 1});
+  bvh_refit(&cached, bounds);
+  TEST_CHECK(bvh_cost(&cached) >= built.build_cost);
+
+  bvh_free(&cached);
+  bvh_free(&built);
+  TEST_CHECK(cached.mapping == NULL);
+  remove(path);
+}
+
+void test_mesh()
+{
+  TriangleMesh mesh;
+  TEST_ASSERT(load_obj("assets/cube.obj", &mesh));
+  TEST_CHECK(mesh.num_triangles == 12);
+
+  Object objects[] = {
+    {.type = GEOMETRY_MESH, .mesh = &mesh},
+    {.center = {0, 0, -10}, .radius = 1},
+  };
+  Options options = {0};
+  Scene scene;
+  init_scene(&scene, objects, 2, &options);
+
+  Ray ray = {{0.25, 0.5, 5}, {0, 0, -1}};
+  Hit hit = {.t = REAL_MAX};
+  TEST_CHECK(intersect(&ray, &scene, &hit));
+  TEST_CHECK(hit.object_id == 0 && fabs(hit.t - 4) < 1e-6);
+  TEST_CHECK(fabs(hit.normal.z - 1) < 1e-6);
+
+  free_scene(&scene);
+  free_mesh(&mesh);
+}
+
+void test_instance()
+{
+  TriangleMesh mesh;
+  TEST_ASSERT(load_obj("assets/cube.obj", &mesh));
+
+  mat4 t, s, m;
+  translate(t, (vec3){5, 0, 0});
+  scale(s, (vec3){2, 2, 2});
+  mat4_mult(t, s, m);
+
+  Transform transforms[2];
+  TEST_CHECK(init_transform(&transforms[0], m));
+  translate(t, (vec3){-5, 0, 0});
+  TEST_CHECK(init_transform(&transforms[1], t));
+
+  Object objects[] = {
+    {.type = GEOMETRY_MESH, .mesh = &mesh, .transform = &transforms[0]},
+    {.type = GEOMETRY_MESH, .mesh = &mesh, .transform = &transforms[1]},
+  };
+  Options options = {0};
+  Scene scene;
+  init_scene(&scene, objects, 2, &options);
+
+  Ray ray = {{5.5, 0.5, 10}, {0, 0, -1}};
+  Hit hit = {.t = REAL_MAX};
+  TEST_CHECK(intersect(&ray, &scene, &hit));
+  TEST_CHECK(hit.object_id == 0 && fabs(hit.t - 8) < 1e-6);
+  TEST_CHECK(fabs(hit.normal.z - 1) < 1e-6);
+
+  ray = (Ray){{-10, 0.5, 0.5}, {1, 0, 0}};
+  hit = (Hit){.t = REAL_MAX};
+  TEST_CHECK(intersect(&ray, &scene, &hit));
+  TEST_CHECK(hit.object_id == 1 && fabs(hit.t - 4) < 1e-6);
+  TEST_CHECK(fabs(hit.normal.x + 1) < 1e-6);
+
+  free_scene(&scene);
+  free_mesh(&mesh);
+}
+
+/*
+ * The integrators make different noise but have to agree on the mean. The
+ * light sphere sits close to the red wall, shadow rays from there have to
+ * clear the origin offset of both ends to reach it.
+ */
+void test_wavefront()
+{
+  const vec3 grey = {0.75, 0.75, 0.75};
+  Object objects[] = {
+    {.type = GEOMETRY_QUAD, .center = {-10, -10, -10}, .edge_u = {20, 0, 0}, .edge_v = {0, 0, 30}, .color = grey},
+    {.type = GEOMETRY_QUAD, .center = {-10, -10, -10}, .edge_u = {20, 0, 0}, .edge_v = {0, 20, 0}, .color = grey},
+    {.type = GEOMETRY_QUAD, .center = {-10, -10, -10}, .edge_u = {0, 0, 30}, .edge_v = {0, 20, 0}, .color = grey},
+    {.type = GEOMETRY_QUAD, .center = {10, -10, -10}, .edge_u = {0, 0, 30}, .edge_v = {0, 20, 0}, .color = {0.75, 0.25, 0.25}},
+    {.type = GEOMETRY_QUAD, .center = {-10, 10, -10}, .edge_u = {20, 0, 0}, .edge_v = {0, 0, 30}, .color = grey},
+    {.type = GEOMETRY_SPHERE, .center = {6, 5, -4}, .radius = 2, .color = {1, 1, 1}, .emission = {2, 1, 0.5}},
+    {.type = GEOMETRY_SPHERE, .center = {-4, -6, 0}, .radius = 3, .color = {1, 1, 1}, .flags = M_REFLECTION},
+    {.type = GEOMETRY_SPHERE, .center = {2, -6, 4}, .radius = 3, .color = {1, 1, 1}, .flags = M_REFRACTION},
+  };
+  Options options = {.width = 16, .height = 12, .samples = 4096, .seed = 1};
+  Scene scene;
+  init_scene(&scene, objects, sizeof(objects) / sizeof(objects[0]), &options);
+
+  Camera camera;
+  init_camera(&camera, VECTOR(0, 0, 19), VECTOR(0, 0, 0), &options);
+  size_t num_pixels = (size_t)options.width * options.height;
+  float *accumulation = malloc(sizeof(*accumulation) * num_pixels * 3);
+  TEST_ASSERT(accumulation != NULL);
+
+  /* recursive, wavefront, wavefront with sorted bounces, recursive with Sobol and blue noise samples */
+  const SamplerType samplers[] = {SAMPLER_RANDOM, SAMPLER_RANDOM, SAMPLER_RANDOM, SAMPLER_SOBOL, SAMPLER_BLUE_NOISE};
+  double mean[5][3] = {{0}};
+  for (int i = 0; i < 5; i++)
+  {
+    options.integrator = i == 1 || i == 2 ? INTEGRATOR_WAVEFRONT : INTEGRATOR_RECURSIVE;
+    options.sort_rays = i == 2;
+    options.sampler = samplers[i];
+    render(accumulation, &scene, &camera, &options);
+    for (size_t p = 0; p < num_pixels * 3; p++)
+      mean[i][p % 3] += accumulation[p] / ((double)num_pixels * options.samples);
+  }
+
+  for (int c = 0; c < 3; c++)
+  {
+    TEST_CHECK(fabs(mean[1][c] - mean[0][c]) < 0.02 * mean[0][c]);
+    TEST_CHECK(fabs(mean[2][c] - mean[0][c]) < 0.02 * mean[0][c]);
+    TEST_CHECK(fabs(mean[3][c] - mean[0][c]) < 0.02 * mean[0][c]);
+    TEST_CHECK(fabs(mean[4][c] - mean[0][c]) < 0.02 * mean[0][c]);
+  }
+
+  free(accumulation);
+  free_scene(&scene);
+}
+
+/* 16 Sobol samples of a pixel put one point in every elementary interval of area 1/16, in every dimension */
+void test_sampler()
+{
+  const uint n = 16;
+  for (uint dimension = 0; dimension < 8; dimension += 7)
+  {
+    uint counts[5][16] = {{0}};
+    bool correlated = true;
+    for (uint s = 0; s < n; s++)
+    {
+      Sampler sampler = sampler_seed(SAMPLER_SOBOL, 9, 12, 34, s);
+      double u, v, next_u, next_v;
+      for (uint d = 0; d < dimension; d++)
+        sample_2d(&sampler, &u, &v);
+      sample_2d(&sampler, &u, &v);
+      sample_2d(&sampler, &next_u, &next_v);
+      correlated &= u == next_u;
+
+      /* 1x16, 2x8, 4x4, 8x2 and 16x1 cells */
+      for (uint k = 0; k < 5; k++)
+      {
+        uint columns = 1u << k, rows = n >> k;
+        counts[k][(uint)(v * rows) * columns + (uint)(u * columns)]++;
+      }
+    }
+
+    bool stratified = true;
+    for (uint k = 0; k < 5; k++)
+      for (uint c = 0; c < n; c++)
+        stratified &= counts[k][c] == 1;
+    TEST_CHECK(stratified);
+    TEST_CHECK(!correlated);
+  }
+
+  /* one blue noise draw over a tile takes every value once, neighbours further apart than white noise */
+  const uint size = 64;
+  uint *bins = calloc(size * size, sizeof(*bins));
+  TEST_ASSERT(bins != NULL);
+  init_sampler(SAMPLER_BLUE_NOISE);
+
+  double distance = 0;
+  for (uint y = 0; y < size; y++)
+    for (uint x = 0; x < size; x++)
+    {
+      Sampler sampler = sampler_seed(SAMPLER_BLUE_NOISE, 9, x, y, 0);
+      Sampler right = sampler_seed(SAMPLER_BLUE_NOISE, 9, x + 1, y, 0);
+      double u = sample_1d(&sampler);
+      bins[(uint)(u * size * size)]++;
+      distance += fabs(u - sample_1d(&right)) / (size * size);
+    }
+
+  bool permutation = true;
+  for (uint i = 0; i < size * size; i++)
+    permutation &= bins[i] == 1;
+  TEST_CHECK(permutation);
+  TEST_CHECK(distance > 0.37);  /* 1/3 for independent values */
+  free(bins);
+
+  /* cosine weighted directions stay on the side of the normal, E[cos] is 2/3 against 1/2 for uniform */
+  vec3 normal = vec3_normalize(VECTOR(1, -2, 0.5));
+  double mean_cos = 0;
+  bool above = true, unit = true;
+  for (uint s = 0; s < 4096; s++)
+  {
+    Sampler sampler = sampler_seed(SAMPLER_RANDOM, 9, 0, 0, s);
+    vec3 direction = random_cosine_direction(normal, &sampler);
+    double cos_theta = vec3_dot(direction, normal);
+    above &= cos_theta >= 0;
+    unit &= fabs(vec3_length(direction) - 1) < 1e-5;
+    mean_cos += cos_theta / 4096;
+  }
+  TEST_CHECK(above && unit);
+  TEST_CHECK(fabs(mean_cos - 2.0 / 3) < 0.01);
+
+  /* 10 samples on a 3 x 4 grid: own cell each, CMJ also its own twelfth of the pixel in x and in y */
+  for (PixelPattern pattern = PIXEL_STRATIFIED; pattern <= PIXEL_CMJ; pattern++)
+  {
+    bool cells[12] = {false}, columns[12] = {false}, rows[12] = {false};
+    bool cell_once = true, column_once = true, row_once = true;
+    for (uint s = 0; s < 10; s++)
+    {
+      Sampler sampler = sampler_seed(SAMPLER_RANDOM, 9, 5, 7, s);
+      double du, dv;
+      sample_pixel(&sampler, pattern, 10, &du, &dv);
+      uint cell = (uint)(dv * 4) * 3 + (uint)(du * 3), column = (uint)(du * 12), row = (uint)(dv * 12);
+      cell_once &= !cells[cell];
+      column_once &= !columns[column];
+      row_once &= !rows[row];
+      cells[cell] = columns[column] = rows[row] = true;
+    }
+    TEST_CHECK(cell_once);
+    if (pattern == PIXEL_CMJ)
+      TEST_CHECK(column_once && row_once);
+  }
+}
+
+void test_sort_rays()
+{
+  const size_t n = 1000;
+  Ray *rays = malloc(sizeof(*rays) * n);
+  uint64_t *keys = malloc(sizeof(*keys) * n);
+  uint *order = malloc(sizeof(*order) * n);
+  bool *seen = calloc(n, sizeof(*seen));
+  TEST_ASSERT(rays != NULL && keys != NULL && order != NULL && seen != NULL);
+
+  Sampler sampler = sampler_seed(SAMPLER_RANDOM, 3, 0, 0, 0);
+  for (size_t i = 0; i < n; i++)
+  {
+    rays[i].origin = vec3_scalar_mult(random_on_unit_sphere(&sampler), 10);
+    rays[i].direction = random_on_unit_sphere(&sampler);
+  }
+  sort_rays(rays, n, keys, order);
+
+  bool sorted = true, permutation = true, octants = true;
+  for (size_t i = 0; i < n; i++)
+  {
+    sorted &= i == 0 || keys[i - 1] <= keys[i];
+    permutation &= order[i] < n && !seen[order[i]];
+    if (order[i] < n)
+      seen[order[i]] = true;
+  }
+  /* rays in the same direction octant stay contiguous */
+  for (size_t i = 1; i < n; i++)
+  {
+    vec3 a = rays[order[i - 1]].direction, b = rays[order[i]].direction;
+    bool same = (a.x < 0) == (b.x < 0) && (a.y < 0) == (b.y < 0) && (a.z < 0) == (b.z < 0);
+    for (size_t j = i + 1; !same && j < n; j++)
+    {
+      vec3 c = rays[order[j]].direction;
+      octants &= !((a.x < 0) == (c.x < 0) && (a.y < 0) == (c.y < 0) && (a.z < 0) == (c.z < 0));
+    }
+  }
+  TEST_CHECK(sorted);
+  TEST_CHECK(permutation);
+  TEST_CHECK(octants);
+
+  free(seen);
+  free(order);
+  free(keys);
+  free(rays);
+}
+
+/* a sample draws the same numbers on any thread, images do not depend on the thread count */
+void test_rng()
+{
+  Rng a = rng_seed(1, 2, 3), b = rng_seed(1, 2, 3), c = rng_seed(1, 2, 4);
+  bool same = true, differs = false, in_range = true;
+  for (int i = 0; i < 100; i++)
+  {
+    double x = rng_double(&a);
+    same &= x == rng_double(&b);
+    differs |= x != rng_double(&c);
+    in_range &= x >= 0 && x < 1;
+  }
+  TEST_CHECK(same);
+  TEST_CHECK(differs);
+  TEST_CHECK(in_range);
+
+  Object objects[] = {
+    {.type = GEOMETRY_SPHERE, .center = {0, 0, 0}, .radius = 3, .color = {0.8, 0.6, 0.4}},
+    {.type = GEOMETRY_SPHERE, .center = {4, 2, 0}, .radius = 1, .color = {1, 1, 1}, .emission = {4, 4, 4}},
+    {.type = GEOMETRY_SPHERE, .center = {-4, -1, 1}, .radius = 1.5, .color = {1, 1, 1}, .flags = M_REFRACTION},
+  };
+  Options options = {.width = 13, .height = 7, .samples = 8, .seed = 5};
+  Scene scene;
+  init_scene(&scene, objects, sizeof(objects) / sizeof(objects[0]), &options);
+
+  Camera camera;
+  init_camera(&camera, VECTOR(0, 0, 12), VECTOR(0, 0, 0), &options);
+  size_t size = sizeof(float) * options.width * options.height * 3;
+  float *one = malloc(size), *many = malloc(size);
+  TEST_ASSERT(one != NULL && many != NULL);
+
+  int threads = omp_get_max_threads();
+  for (int i = 0; i < 2; i++)
+  {
+    options.integrator = i ? INTEGRATOR_WAVEFRONT : INTEGRATOR_RECURSIVE;
+    omp_set_num_threads(1);
+    render(one, &scene, &camera, &options);
+    omp_set_num_threads(3);
+    render(many, &scene, &camera, &options);
+    TEST_CHECK(memcmp(one, many, size) == 0);
+  }
+  omp_set_num_threads(threads);
+
+  free(many);
+  free(one);
+  free_scene(&scene);
+}
+
 int main()
 {
+  init_kernels(ISA_AVX512);
+  test_vector();
   test_normal();
+  test_bvh(BVH_SAH, ACCEL_BVH);
+  test_bvh(BVH_LBVH, ACCEL_BVH);
+  test_bvh(BVH_SAH, ACCEL_BVH8);
+  test_bvh(BVH_LBVH, ACCEL_BVH8);
+  test_bvh(BVH_SAH, ACCEL_GRID);
+  test_primitives();
+  for (Isa isa = ISA_SCALAR; isa <= cpu_isa(); isa++)
+    test_kernels(isa);
+  init_kernels(ISA_AVX512);
+  test_resolve();
+  test_occluded();
+  test_unbounded(BVH_SAH);
+  test_unbounded(BVH_LBVH);
+  test_grid();
+  test_packet(ACCEL_BVH);
+  test_packet(ACCEL_GRID);
+  test_refit(BVH_SAH);
+  test_refit(BVH_LBVH);
+  test_cache();
+  test_mesh();
+  test_instance();
+  test_rng();
+  test_sampler();
+  test_sort_rays();
+  test_wavefront();
   return 0;
 }
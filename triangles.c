@@ -0,0 +1,389 @@
+/*==================[inclusions]============================================*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "raytracer.h"
+
+#ifdef HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/*==================[macros]================================================*/
+/*==================[type definitions]======================================*/
+/*==================[external function declarations]========================*/
+/*==================[internal function declarations]========================*/
+
+static size_t first_slot(size_t slot, uint count);
+static bool closest_lane(const TriangleBuffer *triangles, const REAL *t, const REAL *u, const REAL *v, uint mask, size_t slot, Hit *hit);
+
+/*==================[external constants]====================================*/
+/*==================[internal constants]====================================*/
+/*==================[external data]=========================================*/
+/*==================[internal data]=========================================*/
+/*==================[external function definitions]=========================*/
+
+/*
+ * Copies the triangles into blocks in the order the leaves of bvh appear
+ * and points the leaf ranges of bvh->indices at the slots. A leaf only
+ * shares a block with its predecessors if it fits into what is left of
+ * it, so leaves up to TRIANGLE_BLOCK_SIZE are read from a single block.
+ */
+void triangle_buffer_build(TriangleBuffer *triangles, const Vertex *vertices, BVH *bvh)
+{
+  size_t num_slots = 0;
+  for (uint i = 0; i < bvh->num_nodes; i++)
+  {
+    uint count = bvh->nodes[i].count;
+    if (count > 0)
+      num_slots = first_slot(num_slots, count) + count;
+  }
+
+  triangles->num_blocks = (num_slots + TRIANGLE_BLOCK_SIZE - 1) / TRIANGLE_BLOCK_SIZE;
+  triangles->blocks = NULL;
+  triangles->ids = calloc(MAX(num_slots, 1), sizeof(*triangles->ids));
+  int result = posix_memalign((void **)&triangles->blocks, 64, sizeof(TriangleBlock) * MAX(triangles->num_blocks, 1));
+  assert(result == 0 && triangles->ids != NULL);
+
+  /* unused lanes stay degenerate and never report a hit */
+  memset(triangles->blocks, 0, sizeof(TriangleBlock) * triangles->num_blocks);
+
+  size_t slot = 0;
+  for (uint i = 0; i < bvh->num_nodes; i++)
+  {
+    const BVHNode *node = &bvh->nodes[i];
+    if (node->count == 0)
+      continue;
+
+    slot = first_slot(slot, node->count);
+    for (uint k = 0; k < node->count; k++, slot++)
+    {
+      uint id = bvh->indices[node->left_first + k];
+      const Vertex *v = &vertices[id * 3];
+      vec3 edge1 = vec3_sub(v[1].pos, v[0].pos);
+      vec3 edge2 = vec3_sub(v[2].pos, v[0].pos);
+
+      TriangleBlock *block = &triangles->blocks[slot / TRIANGLE_BLOCK_SIZE];
+      uint lane = slot % TRIANGLE_BLOCK_SIZE;
+      block->v0[0][lane] = v[0].pos.x;
+      block->v0[1][lane] = v[0].pos.y;
+      block->v0[2][lane] = v[0].pos.z;
+      block->edge1[0][lane] = edge1.x;
+      block->edge1[1][lane] = edge1.y;
+      block->edge1[2][lane] = edge1.z;
+      block->edge2[0][lane] = edge2.x;
+      block->edge2[1][lane] = edge2.y;
+      block->edge2[2][lane] = edge2.z;
+
+      triangles->ids[slot] = id;
+      bvh->indices[node->left_first + k] = slot;
+    }
+  }
+}
+
+void triangle_buffer_free(TriangleBuffer *triangles)
+{
+  free(triangles->blocks);
+  free(triangles->ids);
+  memset(triangles, 0, sizeof(*triangles));
+}
+
+#if defined(HAVE_X86_KERNELS) && defined(SINGLE_PRECISION)
+
+/*
+ * Same arithmetic as intersect_triangle(), a block of floats fills one
+ * register per coordinate. The slots first .. first + count - 1 have to
+ * come from a single leaf. On a hit hit->t, hit->primitive_id and the
+ * barycentric coordinates in hit->u and hit->v are set for the closest
+ * triangle, texture coordinates are left to the caller.
+ */
+TARGET_AVX2 bool intersect_triangles_avx2(const TriangleBuffer *triangles, const Ray *ray, uint first, uint count, Hit *hit)
+{
+  const __m256 ox = _mm256_set1_ps(ray->origin.x), oy = _mm256_set1_ps(ray->origin.y), oz = _mm256_set1_ps(ray->origin.z);
+  const __m256 dx = _mm256_set1_ps(ray->direction.x), dy = _mm256_set1_ps(ray->direction.y), dz = _mm256_set1_ps(ray->direction.z);
+  const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+  const __m256 epsilon = _mm256_set1_ps(EPSILON), minus_epsilon = _mm256_set1_ps(-EPSILON);
+  bool found = false;
+
+  intersection_test_count += count;
+
+  for (size_t slot = first, end = (size_t)first + count; slot < end;)
+  {
+    const TriangleBlock *block = &triangles->blocks[slot / TRIANGLE_BLOCK_SIZE];
+    uint lane = slot % TRIANGLE_BLOCK_SIZE, n = MIN(TRIANGLE_BLOCK_SIZE - lane, end - slot);
+    uint mask = ((1u << n) - 1) << lane;
+    size_t base = slot - lane;
+    slot += n;
+
+    __m256 e1x = _mm256_load_ps(block->edge1[0]), e1y = _mm256_load_ps(block->edge1[1]), e1z = _mm256_load_ps(block->edge1[2]);
+    __m256 e2x = _mm256_load_ps(block->edge2[0]), e2y = _mm256_load_ps(block->edge2[1]), e2z = _mm256_load_ps(block->edge2[2]);
+
+    __m256 hx = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    __m256 hy = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    __m256 hz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    __m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, hx), _mm256_mul_ps(e1y, hy)), _mm256_mul_ps(e1z, hz));
+
+    /* rays parallel to the triangle */
+    mask &= _mm256_movemask_ps(_mm256_or_ps(_mm256_cmp_ps(a, minus_epsilon, _CMP_LE_OQ), _mm256_cmp_ps(a, epsilon, _CMP_GE_OQ)));
+    if (mask == 0)
+      continue;
+
+    __m256 f = _mm256_div_ps(one, a);
+    __m256 sx = _mm256_sub_ps(ox, _mm256_load_ps(block->v0[0]));
+    __m256 sy = _mm256_sub_ps(oy, _mm256_load_ps(block->v0[1]));
+    __m256 sz = _mm256_sub_ps(oz, _mm256_load_ps(block->v0[2]));
+    __m256 u = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, hx), _mm256_mul_ps(sy, hy)), _mm256_mul_ps(sz, hz)));
+
+    mask &= _mm256_movemask_ps(_mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, one, _CMP_LE_OQ)));
+    if (mask == 0)
+      continue;
+
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+    __m256 v = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)));
+    __m256 t = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)));
+
+    mask &= _mm256_movemask_ps(_mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ)));
+    mask &= _mm256_movemask_ps(_mm256_cmp_ps(t, zero, _CMP_GT_OQ));
+    if (mask == 0)
+      continue;
+
+    float lanes_t[8], lanes_u[8], lanes_v[8];
+    _mm256_storeu_ps(lanes_t, t);
+    _mm256_storeu_ps(lanes_u, u);
+    _mm256_storeu_ps(lanes_v, v);
+    found |= closest_lane(triangles, lanes_t, lanes_u, lanes_v, mask, base, hit);
+  }
+
+  return found;
+}
+
+#elif defined(HAVE_X86_KERNELS)
+
+/*
+ * Same arithmetic as intersect_triangle() on one block per iteration. The
+ * slots first .. first + count - 1 have to come from a single leaf. On a
+ * hit hit->t, hit->primitive_id and the barycentric coordinates in hit->u
+ * and hit->v are set for the closest triangle, texture coordinates are
+ * left to the caller.
+ */
+TARGET_AVX512 bool intersect_triangles_avx512(const TriangleBuffer *triangles, const Ray *ray, uint first, uint count, Hit *hit)
+{
+  const __m512d ox = _mm512_set1_pd(ray->origin.x), oy = _mm512_set1_pd(ray->origin.y), oz = _mm512_set1_pd(ray->origin.z);
+  const __m512d dx = _mm512_set1_pd(ray->direction.x), dy = _mm512_set1_pd(ray->direction.y), dz = _mm512_set1_pd(ray->direction.z);
+  const __m512d zero = _mm512_setzero_pd(), one = _mm512_set1_pd(1.0);
+  const __m512d epsilon = _mm512_set1_pd(EPSILON), minus_epsilon = _mm512_set1_pd(-EPSILON);
+  bool found = false;
+
+  intersection_test_count += count;
+
+  for (size_t slot = first, end = (size_t)first + count; slot < end;)
+  {
+    const TriangleBlock *block = &triangles->blocks[slot / TRIANGLE_BLOCK_SIZE];
+    uint lane = slot % TRIANGLE_BLOCK_SIZE, n = MIN(TRIANGLE_BLOCK_SIZE - lane, end - slot);
+    __mmask8 mask = (__mmask8)(((1u << n) - 1) << lane);
+    size_t base = slot - lane;
+    slot += n;
+
+    __m512d e1x = _mm512_load_pd(block->edge1[0]), e1y = _mm512_load_pd(block->edge1[1]), e1z = _mm512_load_pd(block->edge1[2]);
+    __m512d e2x = _mm512_load_pd(block->edge2[0]), e2y = _mm512_load_pd(block->edge2[1]), e2z = _mm512_load_pd(block->edge2[2]);
+
+    __m512d hx = _mm512_sub_pd(_mm512_mul_pd(dy, e2z), _mm512_mul_pd(dz, e2y));
+    __m512d hy = _mm512_sub_pd(_mm512_mul_pd(dz, e2x), _mm512_mul_pd(dx, e2z));
+    __m512d hz = _mm512_sub_pd(_mm512_mul_pd(dx, e2y), _mm512_mul_pd(dy, e2x));
+    __m512d a = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(e1x, hx), _mm512_mul_pd(e1y, hy)), _mm512_mul_pd(e1z, hz));
+
+    /* rays parallel to the triangle */
+    mask &= _mm512_cmp_pd_mask(a, minus_epsilon, _CMP_LE_OQ) | _mm512_cmp_pd_mask(a, epsilon, _CMP_GE_OQ);
+    if (mask == 0)
+      continue;
+
+    __m512d f = _mm512_div_pd(one, a);
+    __m512d sx = _mm512_sub_pd(ox, _mm512_load_pd(block->v0[0]));
+    __m512d sy = _mm512_sub_pd(oy, _mm512_load_pd(block->v0[1]));
+    __m512d sz = _mm512_sub_pd(oz, _mm512_load_pd(block->v0[2]));
+    __m512d u = _mm512_mul_pd(f, _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(sx, hx), _mm512_mul_pd(sy, hy)), _mm512_mul_pd(sz, hz)));
+
+    mask &= _mm512_cmp_pd_mask(u, zero, _CMP_GE_OQ) & _mm512_cmp_pd_mask(u, one, _CMP_LE_OQ);
+    if (mask == 0)
+      continue;
+
+    __m512d qx = _mm512_sub_pd(_mm512_mul_pd(sy, e1z), _mm512_mul_pd(sz, e1y));
+    __m512d qy = _mm512_sub_pd(_mm512_mul_pd(sz, e1x), _mm512_mul_pd(sx, e1z));
+    __m512d qz = _mm512_sub_pd(_mm512_mul_pd(sx, e1y), _mm512_mul_pd(sy, e1x));
+    __m512d v = _mm512_mul_pd(f, _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, qx), _mm512_mul_pd(dy, qy)), _mm512_mul_pd(dz, qz)));
+    __m512d t = _mm512_mul_pd(f, _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(e2x, qx), _mm512_mul_pd(e2y, qy)), _mm512_mul_pd(e2z, qz)));
+
+    mask &= _mm512_cmp_pd_mask(v, zero, _CMP_GE_OQ) & _mm512_cmp_pd_mask(_mm512_add_pd(u, v), one, _CMP_LE_OQ);
+    mask &= _mm512_cmp_pd_mask(t, zero, _CMP_GT_OQ);
+    if (mask == 0)
+      continue;
+
+    double lanes_t[8], lanes_u[8], lanes_v[8];
+    _mm512_storeu_pd(lanes_t, t);
+    _mm512_storeu_pd(lanes_u, u);
+    _mm512_storeu_pd(lanes_v, v);
+    found |= closest_lane(triangles, lanes_t, lanes_u, lanes_v, mask, base, hit);
+  }
+
+  return found;
+}
+
+/*
+ * Same arithmetic as intersect_triangle(), a block is tested as two halves
+ * of four lanes and halves without requested slots are skipped. The slots
+ * first .. first + count - 1 have to come from a single leaf. On a hit
+ * hit->t, hit->primitive_id and the barycentric coordinates in hit->u and
+ * hit->v are set for the closest triangle, texture coordinates are left
+ * to the caller.
+ */
+TARGET_AVX2 bool intersect_triangles_avx2(const TriangleBuffer *triangles, const Ray *ray, uint first, uint count, Hit *hit)
+{
+  const __m256d ox = _mm256_set1_pd(ray->origin.x), oy = _mm256_set1_pd(ray->origin.y), oz = _mm256_set1_pd(ray->origin.z);
+  const __m256d dx = _mm256_set1_pd(ray->direction.x), dy = _mm256_set1_pd(ray->direction.y), dz = _mm256_set1_pd(ray->direction.z);
+  const __m256d zero = _mm256_setzero_pd(), one = _mm256_set1_pd(1.0);
+  const __m256d epsilon = _mm256_set1_pd(EPSILON), minus_epsilon = _mm256_set1_pd(-EPSILON);
+  bool found = false;
+
+  intersection_test_count += count;
+
+  for (size_t slot = first, end = (size_t)first + count; slot < end;)
+  {
+    const TriangleBlock *block = &triangles->blocks[slot / TRIANGLE_BLOCK_SIZE];
+    uint lane = slot % TRIANGLE_BLOCK_SIZE, n = MIN(TRIANGLE_BLOCK_SIZE - lane, end - slot);
+    uint requested = ((1u << n) - 1) << lane;
+    size_t base = slot - lane;
+    slot += n;
+
+    for (uint half = 0; half < TRIANGLE_BLOCK_SIZE; half += 4)
+    {
+      uint mask = (requested >> half) & 0xf;
+      if (mask == 0)
+        continue;
+
+      __m256d e1x = _mm256_load_pd(&block->edge1[0][half]), e1y = _mm256_load_pd(&block->edge1[1][half]), e1z = _mm256_load_pd(&block->edge1[2][half]);
+      __m256d e2x = _mm256_load_pd(&block->edge2[0][half]), e2y = _mm256_load_pd(&block->edge2[1][half]), e2z = _mm256_load_pd(&block->edge2[2][half]);
+
+      __m256d hx = _mm256_sub_pd(_mm256_mul_pd(dy, e2z), _mm256_mul_pd(dz, e2y));
+      __m256d hy = _mm256_sub_pd(_mm256_mul_pd(dz, e2x), _mm256_mul_pd(dx, e2z));
+      __m256d hz = _mm256_sub_pd(_mm256_mul_pd(dx, e2y), _mm256_mul_pd(dy, e2x));
+      __m256d a = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e1x, hx), _mm256_mul_pd(e1y, hy)), _mm256_mul_pd(e1z, hz));
+
+      /* rays parallel to the triangle */
+      mask &= _mm256_movemask_pd(_mm256_or_pd(_mm256_cmp_pd(a, minus_epsilon, _CMP_LE_OQ), _mm256_cmp_pd(a, epsilon, _CMP_GE_OQ)));
+      if (mask == 0)
+        continue;
+
+      __m256d f = _mm256_div_pd(one, a);
+      __m256d sx = _mm256_sub_pd(ox, _mm256_load_pd(&block->v0[0][half]));
+      __m256d sy = _mm256_sub_pd(oy, _mm256_load_pd(&block->v0[1][half]));
+      __m256d sz = _mm256_sub_pd(oz, _mm256_load_pd(&block->v0[2][half]));
+      __m256d u = _mm256_mul_pd(f, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(sx, hx), _mm256_mul_pd(sy, hy)), _mm256_mul_pd(sz, hz)));
+
+      mask &= _mm256_movemask_pd(_mm256_and_pd(_mm256_cmp_pd(u, zero, _CMP_GE_OQ), _mm256_cmp_pd(u, one, _CMP_LE_OQ)));
+      if (mask == 0)
+        continue;
+
+      __m256d qx = _mm256_sub_pd(_mm256_mul_pd(sy, e1z), _mm256_mul_pd(sz, e1y));
+      __m256d qy = _mm256_sub_pd(_mm256_mul_pd(sz, e1x), _mm256_mul_pd(sx, e1z));
+      __m256d qz = _mm256_sub_pd(_mm256_mul_pd(sx, e1y), _mm256_mul_pd(sy, e1x));
+      __m256d v = _mm256_mul_pd(f, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, qx), _mm256_mul_pd(dy, qy)), _mm256_mul_pd(dz, qz)));
+      __m256d t = _mm256_mul_pd(f, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e2x, qx), _mm256_mul_pd(e2y, qy)), _mm256_mul_pd(e2z, qz)));
+
+      mask &= _mm256_movemask_pd(_mm256_and_pd(_mm256_cmp_pd(v, zero, _CMP_GE_OQ), _mm256_cmp_pd(_mm256_add_pd(u, v), one, _CMP_LE_OQ)));
+      mask &= _mm256_movemask_pd(_mm256_cmp_pd(t, zero, _CMP_GT_OQ));
+      if (mask == 0)
+        continue;
+
+      double lanes_t[4], lanes_u[4], lanes_v[4];
+      _mm256_storeu_pd(lanes_t, t);
+      _mm256_storeu_pd(lanes_u, u);
+      _mm256_storeu_pd(lanes_v, v);
+      found |= closest_lane(triangles, lanes_t, lanes_u, lanes_v, mask, base + half, hit);
+    }
+  }
+
+  return found;
+}
+
+#endif
+
+bool intersect_triangles_scalar(const TriangleBuffer *triangles, const Ray *ray, uint first, uint count, Hit *hit)
+{
+  bool found = false;
+
+  intersection_test_count += count;
+
+  for (size_t slot = first; slot < (size_t)first + count; slot++)
+  {
+    const TriangleBlock *block = &triangles->blocks[slot / TRIANGLE_BLOCK_SIZE];
+    uint lane = slot % TRIANGLE_BLOCK_SIZE;
+
+    vec3 edge1 = {block->edge1[0][lane], block->edge1[1][lane], block->edge1[2][lane]};
+    vec3 edge2 = {block->edge2[0][lane], block->edge2[1][lane], block->edge2[2][lane]};
+    vec3 h = vec3_cross(ray->direction, edge2);
+    REAL a = vec3_dot(edge1, h);
+    if (a > -EPSILON && a < EPSILON)
+      continue;
+
+    REAL f = 1 / a;
+    vec3 s = vec3_sub(ray->origin, VECTOR(block->v0[0][lane], block->v0[1][lane], block->v0[2][lane]));
+    REAL u = f * vec3_dot(s, h);
+    if (u < 0.0 || u > 1.0)
+      continue;
+
+    vec3 q = vec3_cross(s, edge1);
+    REAL v = f * vec3_dot(ray->direction, q);
+    if (v < 0.0 || u + v > 1.0)
+      continue;
+
+    REAL t = f * vec3_dot(edge2, q);
+    if (t > 0 && t < hit->t)
+    {
+      hit->t = t;
+      hit->u = u;
+      hit->v = v;
+      hit->primitive_id = triangles->ids[slot];
+      found = true;
+    }
+  }
+
+  return found;
+}
+
+/* runs the variant init_kernels() picked for this CPU */
+bool intersect_triangles(const TriangleBuffer *triangles, const Ray *ray, uint first, uint count, Hit *hit)
+{
+  return kernels.intersect_triangles(triangles, ray, first, count, hit);
+}
+
+/*==================[internal function definitions]=========================*/
+
+/* leaves that do not fit into the rest of the current block start a new one */
+size_t first_slot(size_t slot, uint count)
+{
+  uint used = slot % TRIANGLE_BLOCK_SIZE;
+  if (used > 0 && used + count > TRIANGLE_BLOCK_SIZE)
+    slot += TRIANGLE_BLOCK_SIZE - used;
+  return slot;
+}
+
+/* lanes are visited in order so ties resolve like the scalar loop */
+bool closest_lane(const TriangleBuffer *triangles, const REAL *t, const REAL *u, const REAL *v, uint mask, size_t slot, Hit *hit)
+{
+  bool found = false;
+  for (uint lane = 0; mask != 0; lane++, mask >>= 1)
+  {
+    if ((mask & 1) && t[lane] < hit->t)
+    {
+      hit->t = t[lane];
+      hit->u = u[lane];
+      hit->v = v[lane];
+      hit->primitive_id = triangles->ids[slot + lane];
+      found = true;
+    }
+  }
+  return found;
+}
+
+/*==================[end of file]===========================================*/
@@ -3,8 +3,16 @@
 
 #include <tgmath.h>
 #include <assert.h>
+#include <float.h>
 
+/* -DSINGLE_PRECISION traces in float, twice the SIMD lanes at half the footprint */
+#ifdef SINGLE_PRECISION
+typedef float REAL;
+#define REAL_MAX FLT_MAX
+#else
 typedef double REAL;
+#define REAL_MAX DBL_MAX
+#endif
 
 typedef struct { REAL x, y; }       vec2;
 typedef struct { REAL x, y, z; }    vec3;
@@ -47,14 +55,20 @@ inline vec3 vec3_cross(vec3 a, vec3 b)
   a.x * b.y - a.y * b.x, }; 
 }
 
+inline vec3 vec3_min(vec3 a, vec3 b)
+{ return (vec3){a.x < b.x ? a.x : b.x, a.y < b.y ? a.y : b.y, a.z < b.z ? a.z : b.z}; }
+
+inline vec3 vec3_max(vec3 a, vec3 b)
+{ return (vec3){a.x > b.x ? a.x : b.x, a.y > b.y ? a.y : b.y, a.z > b.z ? a.z : b.z}; }
+
 inline int vec3_equal(vec3 a, vec3 b)
 { return a.x == b.x && a.y == b.y && a.z == b.z; }
 
 inline vec3 vec3_normalize(vec3 v)
 {
-  double m = vec3_length(v);
+  REAL m = vec3_length(v);
   assert(m > 0);
-  return vec3_scalar_mult(v, 1.0 / m);
+  return vec3_scalar_mult(v, 1 / m);
 }
 
 #define MAT4_D (4)
@@ -73,6 +87,25 @@ inline vec3 mat4_vector_mult(mat4 A, vec3 v)
   return (vec3){C[0], C[1], C[2]};
 }
 
+inline vec3 mat4_direction_mult(mat4 A, vec3 v)
+{
+  return (vec3){
+    A[0] * v.x + A[1] * v.y + A[2]  * v.z,
+    A[4] * v.x + A[5] * v.y + A[6]  * v.z,
+    A[8] * v.x + A[9] * v.y + A[10] * v.z,
+  };
+}
+
+/* multiplies with the transposed upper 3x3, used to transform normals by an inverse */
+inline vec3 mat4_transpose_direction_mult(mat4 A, vec3 v)
+{
+  return (vec3){
+    A[0] * v.x + A[4] * v.y + A[8]  * v.z,
+    A[1] * v.x + A[5] * v.y + A[9]  * v.z,
+    A[2] * v.x + A[6] * v.y + A[10] * v.z,
+  };
+}
+
 inline void mat4_mult(mat4 A, mat4 B, mat4 C)
 {
   unsigned i, j, k;
@@ -80,7 +113,57 @@ inline void mat4_mult(mat4 A, mat4 B, mat4 C)
   for (i = 0; i < MAT4_D; i++)
     for (j = 0; j < MAT4_D; j++)
       for (k = 0, C[i * MAT4_D + j] = 0; k < MAT4_D; k++)
-        C[i * MAT4_P + j] += (A[i * MAT4_D + k] * B[k * MAT4_P + j]);
+        C[i * MAT4_D + j] += (A[i * MAT4_D + k] * B[k * MAT4_D + j]);
+}
+
+/* gauss-jordan elimination with partial pivoting, returns 0 if A is singular */
+inline int mat4_inverse(mat4 A, mat4 B)
+{
+  unsigned i, j, k;
+  REAL M[MAT4_D * MAT4_D];
+
+  for (i = 0; i < MAT4_D * MAT4_D; i++)
+  {
+    M[i] = A[i];
+    B[i] = (i % (MAT4_D + 1) == 0) ? 1 : 0;
+  }
+
+  for (i = 0; i < MAT4_D; i++)
+  {
+    unsigned pivot = i;
+    for (j = i + 1; j < MAT4_D; j++)
+      if (fabs(M[j * MAT4_D + i]) > fabs(M[pivot * MAT4_D + i]))
+        pivot = j;
+
+    if (M[pivot * MAT4_D + i] == 0)
+      return 0;
+
+    for (k = 0; k < MAT4_D; k++)
+    {
+      REAL tmp = M[i * MAT4_D + k]; M[i * MAT4_D + k] = M[pivot * MAT4_D + k]; M[pivot * MAT4_D + k] = tmp;
+      tmp = B[i * MAT4_D + k]; B[i * MAT4_D + k] = B[pivot * MAT4_D + k]; B[pivot * MAT4_D + k] = tmp;
+    }
+
+    REAL f = 1 / M[i * MAT4_D + i];
+    for (k = 0; k < MAT4_D; k++)
+    {
+      M[i * MAT4_D + k] *= f;
+      B[i * MAT4_D + k] *= f;
+    }
+
+    for (j = 0; j < MAT4_D; j++)
+    {
+      if (j == i)
+        continue;
+      REAL g = M[j * MAT4_D + i];
+      for (k = 0; k < MAT4_D; k++)
+      {
+        M[j * MAT4_D + k] -= g * M[i * MAT4_D + k];
+        B[j * MAT4_D + k] -= g * B[i * MAT4_D + k];
+      }
+    }
+  }
+  return 1;
 }
 
 #endif /* VECTOR_M */
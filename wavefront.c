@@ -0,0 +1,606 @@
+/*==================[inclusions]============================================*/
+
+#include "raytracer.h"
+
+/*==================[macros]================================================*/
+
+#define WAVEFRONT_SIZE  (1 << 16)  /* paths in flight, all samples of a run of pixels */
+#define RAY_SORT_ORIGIN_BITS 9     /* per axis, below the direction octant */
+
+/*==================[type definitions]======================================*/
+
+/*
+ * Every sample of the pixels in flight owns a slot that collects its
+ * radiance and its random numbers. Live paths are compacted after every
+ * bounce, path i continues the sample in slot[i]. Colors are kept per
+ * channel so the flat loops over the queue work on plain arrays.
+ */
+typedef struct
+{
+  size_t capacity, count;
+  size_t first_pixel, num_pixels;
+  uint samples;
+
+  REAL *radiance[3];        /* per slot */
+  Sampler *sampler;         /* per slot, seeded like render() seeds the same sample */
+
+  Ray *rays;
+  Hit *hits;
+  bool *found;
+  bool *alive;
+  bool *specular;           /* came from the camera, a mirror or glass */
+  uint *slot;
+  uint *depth;
+  REAL *throughput[3];
+
+  Ray *shadow_rays;         /* at most one per path, queued by shade() */
+  bool *shadow;
+  REAL *shadow_distance;
+  REAL *shadow_radiance[3];
+
+  uint64_t *keys;           /* sort_rays() scratch, only with Options.sort_rays */
+  uint *order;
+  void *scratch;
+
+  /* compact() scatters the survivors here and swaps them with the fields above */
+  Ray *next_rays;
+  bool *next_specular;
+  uint *next_slot;
+  uint *next_depth;
+  REAL *next_throughput[3];
+} Wavefront;
+
+/* emissive spheres and quads, diffuse hits sample them with shadow rays */
+typedef struct
+{
+  uint *objects;
+  size_t count;
+  bool *is_light;           /* per scene object */
+} Lights;
+
+/*==================[external function declarations]========================*/
+/*==================[internal function declarations]========================*/
+
+static void wavefront_alloc(Wavefront *w, size_t capacity, bool sort);
+static void wavefront_free(Wavefront *w);
+static void collect_lights(Lights *lights, const Scene *scene);
+static void free_lights(Lights *lights);
+static REAL sample_light(const Geometry *geometry, vec3 *point, vec3 *normal, Sampler *sampler);
+
+static void generate(Wavefront *w, const Camera *camera, const Options *options, size_t first_pixel, size_t num_pixels);
+static void reorder(Wavefront *w);
+static void permute(void *data, size_t size, const uint *order, size_t n, void *scratch);
+static void extend(Wavefront *w, const Scene *scene, bool coherent);
+static MULTIVERSION void shade(Wavefront *w, const Scene *scene, const Lights *lights);
+static void shadow(Wavefront *w, const Scene *scene);
+static void compact(Wavefront *w);
+static void accumulate(float *accumulation, const Wavefront *w);
+
+/*==================[external constants]====================================*/
+/*==================[internal constants]====================================*/
+/*==================[external data]=========================================*/
+/*==================[internal data]=========================================*/
+/*==================[external function definitions]=========================*/
+
+/*
+ * Same output as render(), but instead of following one sample depth first
+ * it keeps all samples of a run of pixels in flight and moves them through
+ * the stages together: generate camera rays, extend every path by one hit,
+ * shade the hits, trace the shadow rays shading queued and accumulate the
+ * finished pixels. With Options.sort_rays the bounces are reordered by
+ * direction and origin before each extend, camera rays already come in
+ * pixel order.
+ *
+ * Only the camera rays are traced in packets. Bounces, shading and shadow
+ * rays still go one path at a time through intersect(), shade() and
+ * occluded(), the queues only batch the work between the stages.
+ *
+ * The estimate has the same expected value as trace_path(), the noise is
+ * different: diffuse hits sample emissive spheres and quads directly and
+ * skip their emission when a bounce finds them, and glass follows one of
+ * reflection and refraction picked by the Fresnel weight instead of both.
+ */
+void render_wavefront(float *accumulation, const Scene *scene, Camera *camera, Options *options)
+{
+  size_t num_pixels = (size_t)options->width * options->height;
+  size_t chunk = MAX(WAVEFRONT_SIZE / MAX(options->samples, 1), 1);
+
+  Wavefront w;
+  Lights lights;
+  wavefront_alloc(&w, chunk * options->samples, options->sort_rays);
+  collect_lights(&lights, scene);
+
+  for (size_t first = 0; first < num_pixels; first += chunk)
+  {
+    generate(&w, camera, options, first, MIN(chunk, num_pixels - first));
+
+    for (uint bounce = 0; w.count > 0; bounce++)
+    {
+      if (options->sort_rays && bounce > 0)
+        reorder(&w);
+      extend(&w, scene, bounce == 0);
+      shade(&w, scene, &lights);
+      shadow(&w, scene);
+      compact(&w);
+    }
+
+    accumulate(accumulation, &w);
+  }
+
+  free_lights(&lights);
+  wavefront_free(&w);
+}
+
+/*
+ * Fills order with the indices of rays sorted so that neighbours start
+ * close to each other and point the same way, which keeps consecutive
+ * traversals in the same part of the tree. The key is the octant of the
+ * direction followed by the Morton code of the origin within the bounds of
+ * all origins, RAY_SORT_ORIGIN_BITS per axis. Finer directions split the
+ * origins of short bounces too far apart to pay off. The key is short, so
+ * radix_sort() skips most of its passes. keys is scratch space for n codes.
+ */
+void sort_rays(const Ray *rays, size_t n, uint64_t *keys, uint *order)
+{
+  const int origin_shift = 3 * (MORTON_BITS - RAY_SORT_ORIGIN_BITS);
+
+  double min_x = DBL_MAX, min_y = DBL_MAX, min_z = DBL_MAX;
+  double max_x = -DBL_MAX, max_y = -DBL_MAX, max_z = -DBL_MAX;
+
+  #pragma omp parallel for reduction(min:min_x, min_y, min_z) reduction(max:max_x, max_y, max_z)
+  for (int64_t i = 0; i < (int64_t)n; i++)
+  {
+    vec3 o = rays[i].origin;
+    min_x = MIN(min_x, o.x), min_y = MIN(min_y, o.y), min_z = MIN(min_z, o.z);
+    max_x = MAX(max_x, o.x), max_y = MAX(max_y, o.y), max_z = MAX(max_z, o.z);
+  }
+
+  vec3 origin = {min_x, min_y, min_z};
+  vec3 scale = {
+    max_x > min_x ? 1.0 / (max_x - min_x) : 0,
+    max_y > min_y ? 1.0 / (max_y - min_y) : 0,
+    max_z > min_z ? 1.0 / (max_z - min_z) : 0,
+  };
+
+  #pragma omp parallel for
+  for (int64_t i = 0; i < (int64_t)n; i++)
+  {
+    vec3 d = rays[i].direction;
+    uint64_t octant = (d.x < 0) << 2 | (d.y < 0) << 1 | (d.z < 0);
+    uint64_t position = morton_code(vec3_mult(vec3_sub(rays[i].origin, origin), scale)) >> origin_shift;
+    keys[i] = octant << (3 * RAY_SORT_ORIGIN_BITS) | position;
+    order[i] = i;
+  }
+
+  radix_sort(keys, order, n);
+}
+
+/*==================[internal function definitions]=========================*/
+
+void wavefront_alloc(Wavefront *w, size_t capacity, bool sort)
+{
+  *w = (Wavefront){.capacity = capacity};
+
+  w->rays = malloc(sizeof(*w->rays) * capacity);
+  w->hits = malloc(sizeof(*w->hits) * capacity);
+  w->found = malloc(sizeof(*w->found) * capacity);
+  w->alive = malloc(sizeof(*w->alive) * capacity);
+  w->specular = malloc(sizeof(*w->specular) * capacity);
+  w->slot = malloc(sizeof(*w->slot) * capacity);
+  w->depth = malloc(sizeof(*w->depth) * capacity);
+  w->shadow_rays = malloc(sizeof(*w->shadow_rays) * capacity);
+  w->shadow = malloc(sizeof(*w->shadow) * capacity);
+  w->shadow_distance = malloc(sizeof(*w->shadow_distance) * capacity);
+  w->sampler = malloc(sizeof(*w->sampler) * capacity);
+  assert(w->rays != NULL && w->hits != NULL && w->found != NULL && w->alive != NULL && w->specular != NULL);
+  assert(w->slot != NULL && w->depth != NULL && w->shadow_rays != NULL && w->shadow != NULL && w->shadow_distance != NULL && w->sampler != NULL);
+
+  for (uint c = 0; c < 3; c++)
+  {
+    w->radiance[c] = malloc(sizeof(REAL) * capacity);
+    w->throughput[c] = malloc(sizeof(REAL) * capacity);
+    w->shadow_radiance[c] = malloc(sizeof(REAL) * capacity);
+    w->next_throughput[c] = malloc(sizeof(REAL) * capacity);
+    assert(w->radiance[c] != NULL && w->throughput[c] != NULL && w->shadow_radiance[c] != NULL && w->next_throughput[c] != NULL);
+  }
+
+  w->next_rays = malloc(sizeof(*w->next_rays) * capacity);
+  w->next_specular = malloc(sizeof(*w->next_specular) * capacity);
+  w->next_slot = malloc(sizeof(*w->next_slot) * capacity);
+  w->next_depth = malloc(sizeof(*w->next_depth) * capacity);
+  assert(w->next_rays != NULL && w->next_specular != NULL && w->next_slot != NULL && w->next_depth != NULL);
+
+  if (sort)
+  {
+    w->keys = malloc(sizeof(*w->keys) * capacity);
+    w->order = malloc(sizeof(*w->order) * capacity);
+    w->scratch = malloc(sizeof(Ray) * capacity);  /* the largest per path field */
+    assert(w->keys != NULL && w->order != NULL && w->scratch != NULL);
+  }
+}
+
+void wavefront_free(Wavefront *w)
+{
+  for (uint c = 0; c < 3; c++)
+  {
+    free(w->radiance[c]);
+    free(w->throughput[c]);
+    free(w->shadow_radiance[c]);
+    free(w->next_throughput[c]);
+  }
+  free(w->rays);
+  free(w->hits);
+  free(w->found);
+  free(w->alive);
+  free(w->specular);
+  free(w->slot);
+  free(w->depth);
+  free(w->shadow_rays);
+  free(w->shadow);
+  free(w->shadow_distance);
+  free(w->sampler);
+  free(w->keys);
+  free(w->order);
+  free(w->scratch);
+  free(w->next_rays);
+  free(w->next_specular);
+  free(w->next_slot);
+  free(w->next_depth);
+  *w = (Wavefront){0};
+}
+
+void collect_lights(Lights *lights, const Scene *scene)
+{
+  lights->objects = malloc(sizeof(*lights->objects) * MAX(scene->num_objects, 1));
+  lights->is_light = calloc(MAX(scene->num_objects, 1), sizeof(*lights->is_light));
+  assert(lights->objects != NULL && lights->is_light != NULL);
+  lights->count = 0;
+
+  for (uint i = 0; i < scene->num_objects; i++)
+  {
+    vec3 emission = scene->materials[i].emission;
+    GeometryType type = scene->geometry[i].type;
+
+    if ((type == GEOMETRY_SPHERE || type == GEOMETRY_QUAD) && (emission.x > 0 || emission.y > 0 || emission.z > 0))
+    {
+      lights->objects[lights->count++] = i;
+      lights->is_light[i] = true;
+    }
+  }
+}
+
+void free_lights(Lights *lights)
+{
+  free(lights->objects);
+  free(lights->is_light);
+}
+
+/* uniform point on the surface of a light, returns the area it was picked from */
+REAL sample_light(const Geometry *geometry, vec3 *point, vec3 *normal, Sampler *sampler)
+{
+  if (geometry->type == GEOMETRY_SPHERE)
+  {
+    REAL radius = geometry->shape.radius;
+    *normal = random_on_unit_sphere(sampler);
+    *point = vec3_add(geometry->center, vec3_scalar_mult(*normal, radius));
+    return 4 * PI * radius * radius;
+  }
+
+  const vec3 *edge = geometry->shape.edge;
+  vec3 n = vec3_cross(edge[0], edge[1]);
+  double u, v;
+  sample_2d(sampler, &u, &v);
+  *point = vec3_add(geometry->center, vec3_add(vec3_scalar_mult(edge[0], u), vec3_scalar_mult(edge[1], v)));
+  *normal = vec3_normalize(n);
+  return vec3_length(n);
+}
+
+void generate(Wavefront *w, const Camera *camera, const Options *options, size_t first_pixel, size_t num_pixels)
+{
+  w->first_pixel = first_pixel;
+  w->num_pixels = num_pixels;
+  w->samples = options->samples;
+  w->count = num_pixels * options->samples;
+  assert(w->count <= w->capacity);
+
+  #pragma omp parallel for
+  for (size_t i = 0; i < w->count; i++)
+  {
+    size_t pixel = first_pixel + i / w->samples;
+    uint x = pixel % options->width, y = pixel / options->width;
+    double du, dv;
+    w->sampler[i] = sampler_seed(options->sampler, options->seed, x, y, i % w->samples);
+    sample_pixel(&w->sampler[i], options->pixel, w->samples, &du, &dv);
+    double u = (x + du) / ((double)options->width - 1.0);
+    double v = (y + dv) / ((double)options->height - 1.0);
+
+    w->rays[i] = get_camera_ray(camera, u, v);
+    w->slot[i] = i;
+    w->depth[i] = 0;
+    w->specular[i] = true;
+    for (uint c = 0; c < 3; c++)
+    {
+      w->throughput[c][i] = 1;
+      w->radiance[c][i] = 0;
+    }
+  }
+}
+
+/* moves the live paths into sort_rays() order, the slots keep them tied to their pixels */
+void reorder(Wavefront *w)
+{
+  sort_rays(w->rays, w->count, w->keys, w->order);
+
+  permute(w->rays, sizeof(*w->rays), w->order, w->count, w->scratch);
+  permute(w->slot, sizeof(*w->slot), w->order, w->count, w->scratch);
+  permute(w->depth, sizeof(*w->depth), w->order, w->count, w->scratch);
+  permute(w->specular, sizeof(*w->specular), w->order, w->count, w->scratch);
+  for (uint c = 0; c < 3; c++)
+    permute(w->throughput[c], sizeof(REAL), w->order, w->count, w->scratch);
+}
+
+/* data[i] = data[order[i]] for elements of size bytes, through scratch */
+void permute(void *data, size_t size, const uint *order, size_t n, void *scratch)
+{
+  #pragma omp parallel for
+  for (size_t i = 0; i < n; i++)
+    memcpy((char *)scratch + i * size, (const char *)data + order[i] * size, size);
+  memcpy(data, scratch, n * size);
+}
+
+/*
+ * Finds the next hit of every path, paths past MAX_DEPTH see the
+ * background like trace_path(). A coherent queue, the camera rays that
+ * come as the samples of one pixel after another, is traced in packets of
+ * PACKET_SIZE neighbours with intersect_packet(). Bounces are traced one
+ * ray at a time, their lanes split up after the first few nodes and the
+ * packet then visits the boxes of all of them, even after reorder().
+ */
+void extend(Wavefront *w, const Scene *scene, bool coherent)
+{
+  ray_count += w->count;
+
+  if (!coherent)
+  {
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (size_t i = 0; i < w->count; i++)
+    {
+      w->hits[i] = (Hit){.t = REAL_MAX};
+      w->found[i] = w->depth[i] <= MAX_DEPTH && intersect(&w->rays[i], scene, &w->hits[i]);
+    }
+    return;
+  }
+
+  #pragma omp parallel for schedule(dynamic, 32)
+  for (size_t first = 0; first < w->count; first += PACKET_SIZE)
+  {
+    uint lanes = MIN(PACKET_SIZE, w->count - first), active = 0;
+    for (uint i = 0; i < lanes; i++)
+    {
+      w->hits[first + i] = (Hit){.t = REAL_MAX};
+      if (w->depth[first + i] <= MAX_DEPTH)
+        active |= 1u << i;
+    }
+
+    uint found = intersect_packet(&w->rays[first], active, scene, &w->hits[first]);
+    for (uint i = 0; i < lanes; i++)
+      w->found[first + i] = (found >> i) & 1;
+  }
+}
+
+/* shade_path() for one hit per path, the bounce replaces the ray instead of recursing */
+MULTIVERSION void shade(Wavefront *w, const Scene *scene, const Lights *lights)
+{
+  #pragma omp parallel for schedule(dynamic, 256)
+  for (size_t i = 0; i < w->count; i++)
+  {
+    uint slot = w->slot[i];
+    Sampler *sampler = &w->sampler[slot];
+    vec3 throughput = {w->throughput[0][i], w->throughput[1][i], w->throughput[2][i]};
+    vec3 radiance = ZERO_VECTOR;
+
+    w->alive[i] = false;
+    w->shadow[i] = false;
+
+    if (!w->found[i])
+    {
+      radiance = vec3_mult(throughput, BACKGROUND);
+    }
+    else
+    {
+      const Hit *hit = &w->hits[i];
+      const Material *material = &scene->materials[hit->object_id];
+      vec3 albedo = material->color;
+
+      /* a light reached by a diffuse bounce was already sampled by its shadow ray */
+      if (w->specular[i] || !lights->is_light[hit->object_id])
+        radiance = vec3_mult(throughput, material->emission);
+
+      /* russian roulette */
+      double prob = MAX(albedo.x, MAX(albedo.y, albedo.z));
+
+      if (sample_1d(sampler) < prob)
+      {
+        albedo = vec3_scalar_mult(albedo, 1 / prob);
+
+        if (material->flags & M_CHECKERED)
+          albedo = checkered_texture(albedo, hit->u, hit->v, 100000);
+
+        const vec3 in = w->rays[i].direction;
+        vec3 direction;
+        bool specular = true;
+
+        if (material->flags & M_REFRACTION)
+        {
+          double facingratio = -vec3_dot(in, hit->normal);
+          double fresnel = mix(pow(1 - facingratio, 3), 1, 0.1);
+
+          if (sample_1d(sampler) < fresnel)
+            direction = vec3_normalize(reflect(in, hit->normal));
+          else
+            direction = vec3_normalize(refract(vec3_scalar_mult(in, -1), hit->normal, 1.0));
+        }
+        else if (material->flags & M_REFLECTION)
+        {
+          direction = reflect(in, hit->normal);
+        }
+        else
+        {
+          specular = false;
+
+          /* no shadow ray where trace_path() would stop before reaching the light */
+          if (lights->count > 0 && w->depth[i] < MAX_DEPTH)
+          {
+            uint light = lights->objects[(size_t)(sample_1d(sampler) * lights->count)];
+            vec3 point, normal;
+            REAL area = sample_light(&scene->geometry[light], &point, &normal, sampler);
+
+            vec3 to_light = vec3_sub(point, hit->point);
+            REAL distance2 = vec3_dot(to_light, to_light);
+            REAL distance = sqrt(distance2);
+            vec3 dir = vec3_scalar_div(to_light, distance);
+            REAL cos_surface = vec3_dot(dir, hit->normal);
+            REAL cos_light = -vec3_dot(dir, normal);
+
+            /* quads shine both ways, spheres only outwards */
+            if (scene->geometry[light].type == GEOMETRY_QUAD)
+              cos_light = fabs(cos_light);
+
+            if (cos_surface > 0 && cos_light > 0)
+            {
+              /* the same albedo / (2 PI) per steradian the bounce below weighs with DIFFUSE_WEIGHT */
+              REAL weight = cos_surface * cos_light * area * lights->count / (2 * PI * distance2);
+              vec3 light_radiance = vec3_scalar_mult(vec3_mult(vec3_mult(throughput, albedo), scene->materials[light].emission), weight);
+
+              /* both ends leave their surface like any secondary ray, so neither is hit itself */
+              Ray ray = spawn_ray(hit, dir);
+              vec3 target = offset_ray_origin(point, vec3_dot(dir, normal) < 0 ? normal : vec3_scalar_mult(normal, -1));
+              vec3 to_target = vec3_sub(target, ray.origin);
+              REAL length = vec3_length(to_target);
+              ray.direction = vec3_scalar_div(to_target, length);
+
+              w->shadow_rays[i] = ray;
+              w->shadow_distance[i] = length;
+              w->shadow_radiance[0][i] = light_radiance.x;
+              w->shadow_radiance[1][i] = light_radiance.y;
+              w->shadow_radiance[2][i] = light_radiance.z;
+              w->shadow[i] = true;
+            }
+          }
+
+          direction = random_cosine_direction(hit->normal, sampler);
+          albedo = vec3_scalar_mult(albedo, DIFFUSE_WEIGHT);
+        }
+
+        throughput = vec3_mult(throughput, albedo);
+        w->rays[i] = spawn_ray(hit, direction);
+        w->specular[i] = specular;
+        w->depth[i]++;
+        w->alive[i] = true;
+      }
+    }
+
+    w->throughput[0][i] = throughput.x;
+    w->throughput[1][i] = throughput.y;
+    w->throughput[2][i] = throughput.z;
+    w->radiance[0][slot] += radiance.x;
+    w->radiance[1][slot] += radiance.y;
+    w->radiance[2][slot] += radiance.z;
+  }
+}
+
+/* each slot has at most one path and so at most one shadow ray, no two write the same slot */
+void shadow(Wavefront *w, const Scene *scene)
+{
+  #pragma omp parallel for schedule(dynamic, 256)
+  for (size_t i = 0; i < w->count; i++)
+  {
+    if (w->shadow[i] && !occluded(&w->shadow_rays[i], scene, w->shadow_distance[i]))
+    {
+      uint slot = w->slot[i];
+      for (uint c = 0; c < 3; c++)
+        w->radiance[c][slot] += w->shadow_radiance[c][i];
+    }
+  }
+}
+
+/*
+ * Drops finished paths, the survivors keep their order. Every thread
+ * counts the survivors of its share of the queue, an exclusive prefix sum
+ * over the counts gives the position of each share in the next_ fields and
+ * the threads scatter their survivors there. Then the two sets of fields
+ * trade places.
+ */
+void compact(Wavefront *w)
+{
+  int max_threads = omp_get_max_threads();
+  size_t *offsets = malloc(sizeof(*offsets) * max_threads);
+  size_t n = w->count, survivors = 0;
+  assert(offsets != NULL);
+
+  #pragma omp parallel num_threads(max_threads)
+  {
+    int t = omp_get_thread_num(), num_threads = omp_get_num_threads();
+    size_t begin = n * t / num_threads, end = n * (t + 1) / num_threads;
+    size_t count = 0;
+
+    for (size_t i = begin; i < end; i++)
+      count += w->alive[i];
+    offsets[t] = count;
+
+    #pragma omp barrier
+    #pragma omp single
+    {
+      for (int u = 0; u < num_threads; u++)
+      {
+        size_t share = offsets[u];
+        offsets[u] = survivors;
+        survivors += share;
+      }
+    }
+
+    size_t pos = offsets[t];
+    for (size_t i = begin; i < end; i++)
+    {
+      if (!w->alive[i])
+        continue;
+
+      w->next_rays[pos] = w->rays[i];
+      w->next_slot[pos] = w->slot[i];
+      w->next_depth[pos] = w->depth[i];
+      w->next_specular[pos] = w->specular[i];
+      for (uint c = 0; c < 3; c++)
+        w->next_throughput[c][pos] = w->throughput[c][i];
+      pos++;
+    }
+  }
+  free(offsets);
+
+  Ray *rays = w->rays; w->rays = w->next_rays; w->next_rays = rays;
+  uint *slot = w->slot; w->slot = w->next_slot; w->next_slot = slot;
+  uint *depth = w->depth; w->depth = w->next_depth; w->next_depth = depth;
+  bool *specular = w->specular; w->specular = w->next_specular; w->next_specular = specular;
+  for (uint c = 0; c < 3; c++)
+  {
+    REAL *throughput = w->throughput[c]; w->throughput[c] = w->next_throughput[c]; w->next_throughput[c] = throughput;
+  }
+  w->count = survivors;
+}
+
+/* sums the slots of every pixel into accumulation, in sample order like render() */
+void accumulate(float *accumulation, const Wavefront *w)
+{
+  #pragma omp parallel for
+  for (size_t p = 0; p < w->num_pixels; p++)
+  {
+    for (uint c = 0; c < 3; c++)
+    {
+      REAL sum = 0;
+      for (uint s = 0; s < w->samples; s++)
+        sum += w->radiance[c][p * w->samples + s];
+      accumulation[(w->first_pixel + p) * 3 + c] = sum;
+    }
+  }
+}
+
+/*==================[end of file]===========================================*/